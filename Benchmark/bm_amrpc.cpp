@@ -2,6 +2,9 @@
 // Created by yyz on 2020/1/15.
 //
 
+#include <atomic>
+#include <chrono>
+
 #include <benchmark/benchmark.h>
 #include <ecv/strings.h>
 
@@ -10,6 +13,18 @@
 using namespace std;
 using namespace amrpc;
 
+extern atomic<size_t> bm_alloc_count;
+
+//spin until done(), false after timeout
+template<typename Done>
+static bool SpinUntil(Done&& done, chrono::milliseconds timeout = chrono::seconds(5)) {
+    auto deadline = chrono::steady_clock::now() + timeout;
+    while (!done()) {
+        if (chrono::steady_clock::now() >= deadline) return false;
+    }
+    return true;
+}
+
 static void BM_IPC_RPC(benchmark::State& state) {
     constexpr static string_view SERVER_ADDRESS = "ipc://bm.ipc";
     constexpr static string_view METHOD = "/bm_rpc";
@@ -22,6 +37,7 @@ static void BM_IPC_RPC(benchmark::State& state) {
     auto data = ecv::RandomString(data_size);
     RemoteFunction<string(string)> func(SERVER_ADDRESS, METHOD);
     while (func.Enabled().wait().hasException()) /*wait for server ready*/;
+    auto allocs = bm_alloc_count.load();
     for (auto _ : state) {
         state.PauseTiming();
         auto cp_data = data;
@@ -29,8 +45,73 @@ static void BM_IPC_RPC(benchmark::State& state) {
         func(move(cp_data)).get();
     }
 
+    state.counters["allocs"] = benchmark::Counter(bm_alloc_count - allocs, benchmark::Counter::kAvgIterations);
     state.SetItemsProcessed(state.iterations());
     state.SetBytesProcessed(state.iterations() * data_size);
 }
 
-BENCHMARK(BM_IPC_RPC)->Range(1 << 10, 1 << 10 << 10)->UseRealTime();
\ No newline at end of file
+BENCHMARK(BM_IPC_RPC)->Range(1 << 10, 1 << 10 << 10)->UseRealTime();
+
+static void BM_IPC_PUBLISH(benchmark::State& state) {
+    constexpr static string_view SERVER_ADDRESS = "ipc://bm.ipc";
+    constexpr static string_view METHOD = "/bm_publish";
+    constexpr static int64_t MAX_IN_FLIGHT = 512;
+    Server server(SERVER_ADDRESS);
+    server.AddPublish<Bytes>(METHOD, MAX_IN_FLIGHT * 2);
+
+    atomic<int64_t> received = {0};
+    auto puller = Pull<Bytes>(SERVER_ADDRESS, METHOD, [&received](folly::Try<Bytes>&& t) {
+        if (t.hasValue()) ++received;
+    }).get();
+
+    auto data_size = state.range(0);
+    Bytes data(ecv::RandomString(data_size));
+    int64_t sent = 0;
+    auto allocs = bm_alloc_count.load();
+    for (auto _ : state) {
+        server.Publish(METHOD, Bytes(data));
+        ++sent;
+        //stay below the subscriber high-watermark
+        if (!SpinUntil([&]() { return sent - received <= MAX_IN_FLIGHT; })) {
+            state.SkipWithError("publish lost: puller stalled");
+            break;
+        }
+    }
+    if (!SpinUntil([&]() { return received >= sent; })) {
+        state.SkipWithError("publish lost: puller did not receive every message");
+        return;
+    }
+
+    state.counters["allocs"] = benchmark::Counter(bm_alloc_count - allocs, benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * data_size);
+}
+
+BENCHMARK(BM_IPC_PUBLISH)->Range(1 << 6, 1 << 10 << 10)->UseRealTime();
+
+static void BM_BASE64_ENCODE(benchmark::State& state) {
+    auto data = ecv::RandomString(state.range(0));
+    string out;
+    for (auto _ : state) {
+        out.clear();
+        detail::Base64Encode(data, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_BASE64_ENCODE)->Range(1 << 6, 1 << 10 << 10);
+
+static void BM_BASE64_DECODE(benchmark::State& state) {
+    string encoded;
+    detail::Base64Encode(ecv::RandomString(state.range(0)), encoded);
+    string out;
+    for (auto _ : state) {
+        out.clear();
+        detail::Base64Decode(encoded, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_BASE64_DECODE)->Range(1 << 6, 1 << 10 << 10);
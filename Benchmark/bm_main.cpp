@@ -1,6 +1,27 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
 #include <benchmark/benchmark.h>
 #include <boost/thread.hpp>
 
+//Counts operator new of the whole process, reported as allocs per iteration
+std::atomic<std::size_t> bm_alloc_count = {0};
+
+void* operator new(std::size_t size) {
+    bm_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
 void link_boost_thread_tag() {
     boost::thread t;
     return;
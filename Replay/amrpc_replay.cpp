@@ -0,0 +1,83 @@
+#include <atomic>
+#include <map>
+#include <optional>
+#include <set>
+#include <thread>
+
+#include <folly/futures/Future.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "amrpc.h"
+
+DEFINE_string(capture, "", "capture file written by Server::StartCapture");
+DEFINE_string(host, "", "server receiving the captured rpc requests, empty to skip them");
+DEFINE_string(serve, "", "uri publishing the captured publishes, empty to skip them");
+DEFINE_double(speed, 1.0, "replay speed relative to the capture, 0 for as fast as possible");
+DEFINE_uint32(queue_size, 100, "queue size of the replayed publishes");
+
+using namespace std;
+
+namespace {
+class Caller : public amrpc::detail::RawRemoteFunction {
+public:
+    using RawRemoteFunction::RawRemoteFunction;
+    using RawRemoteFunction::RawCall;
+};
+
+class Replayer : public amrpc::Server {
+public:
+    using Server::Server;
+
+    void Republish(amrpc::detail::MessageType type, const string& method, string&& payload) {
+        if (methods_.insert(method).second) AddRawPublish(type, method, method, FLAGS_queue_size);
+        RawPublish(type, method, move(payload));
+    }
+
+private:
+    set<string> methods_;
+};
+}//namespace
+
+int main(int argc, char** argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+
+    amrpc::detail::CaptureReader reader(FLAGS_capture);
+    optional<Replayer> server;
+    if (!FLAGS_serve.empty()) server.emplace(FLAGS_serve);
+    //Caller keeps a view of the method, map keys are stable
+    map<string, unique_ptr<Caller>, less<>> callers;
+    vector<folly::Future<folly::Unit>> calls;
+    atomic<size_t> failed = {0};
+    size_t publishes = 0;
+
+    amrpc::detail::CaptureRecord record;
+    auto start = chrono::steady_clock::now();
+    while (reader.Next(record)) {
+        if (FLAGS_speed > 0) {
+            this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(
+                record.time / FLAGS_speed));
+        }
+        if (record.kind == amrpc::detail::CAPTURE_RPC) {
+            if (FLAGS_host.empty()) continue;
+            auto it = callers.find(record.method);
+            if (it == callers.end()) {
+                it = callers.emplace(record.method, nullptr).first;
+                it->second = make_unique<Caller>(FLAGS_host, it->first);
+            }
+            auto data = make_shared<const string>(move(record.payload));
+            calls.emplace_back(it->second->RawCall(record.type, *data).via(&amrpc::detail::GetAmrpcExecutor())
+                                   .thenTry([data, &failed](folly::Try<string>&& t) {
+                                       if (t.hasException()) ++failed;
+                                   }));
+        } else if (server) {
+            server->Republish(record.type, record.method, move(record.payload));
+            ++publishes;
+        }
+    }
+    folly::collectAll(calls.begin(), calls.end()).wait();
+    LOG(INFO) << "replayed " << calls.size() << " rpc (" << failed << " failed), " << publishes << " publishes in "
+              << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s";
+    return 0;
+}
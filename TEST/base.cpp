@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <glog/logging.h>
+#include <random>
 
 #include "amrpc.h"
 
@@ -7,3 +8,61 @@ TEST(base,base){
 
 }
 
+TEST(base, base64) {
+    std::string data;
+    for (int i = 0; i < 1000; ++i) data.push_back(static_cast<char>(i * 7));
+    for (size_t size : {0, 1, 2, 3, 15, 16, 28, 31, 32, 33, 100, 1000}) {
+        std::string encoded;
+        amrpc::detail::Base64Encode(std::string_view(data).substr(0, size), encoded);
+        ASSERT_EQ(encoded.size(), amrpc::detail::Base64EncodedSize(size));
+        std::string decoded;
+        ASSERT_TRUE(amrpc::detail::Base64Decode(encoded, decoded));
+        EXPECT_EQ(decoded, data.substr(0, size));
+    }
+    std::string out;
+    amrpc::detail::Base64Encode("amrpc", out);
+    EXPECT_EQ(out, "YW1ycGM=");
+    EXPECT_FALSE(amrpc::detail::Base64Decode("YW1y-GM=", out));
+    EXPECT_EQ(out, "YW1ycGM=");
+    //plain msgpack needs BIN for Bytes
+    auto packed = amrpc::detail::PackToString(std::string("YW1ycGM="));
+    auto oh = msgpack::unpack(packed.data(), packed.size());
+    EXPECT_THROW(oh.get().as<amrpc::Bytes>(), msgpack::type_error);
+    //a json request carries Bytes as a base64 string
+    packed = amrpc::detail::JsonToMsgpack<std::tuple<amrpc::Bytes, std::string>>(R"(["YW1ycGM=", "YW1ycGM="])");
+    oh = msgpack::unpack(packed.data(), packed.size());
+    auto[bytes, str] = oh.get().as<std::tuple<amrpc::Bytes, std::string>>();
+    EXPECT_EQ(bytes, "amrpc");
+    EXPECT_EQ(str, "YW1ycGM=");
+}
+
+TEST(base, base64Tiers) {
+    auto tiers = amrpc::detail::Base64Tiers();
+    std::mt19937 rng(7);
+    //none of these is in the alphabet, '=' is left out as it may read as padding at the end
+    constexpr std::string_view invalid("-.\0 \x80\xff", 6);
+    for (size_t size = 0; size <= 300; ++size) {
+        std::string data;
+        for (size_t i = 0; i < size; ++i) data.push_back(static_cast<char>(rng()));
+        std::string encoded;
+        amrpc::detail::Base64Encode(data, encoded, amrpc::detail::BASE64_SCALAR);
+        for (auto tier : tiers) {
+            std::string out;
+            amrpc::detail::Base64Encode(data, out, tier);
+            ASSERT_EQ(out, encoded) << "tier " << tier << " size " << size;
+            out.clear();
+            ASSERT_TRUE(amrpc::detail::Base64Decode(encoded, out, tier)) << "tier " << tier << " size " << size;
+            ASSERT_EQ(out, data) << "tier " << tier << " size " << size;
+        }
+        //a bad character is caught at every lane position
+        for (size_t pos = 0; pos < encoded.size(); ++pos) {
+            auto bad = encoded;
+            bad[pos] = invalid[pos % invalid.size()];
+            for (auto tier : tiers) {
+                std::string out = "x";
+                ASSERT_FALSE(amrpc::detail::Base64Decode(bad, out, tier)) << "tier " << tier << " pos " << pos;
+                ASSERT_EQ(out, "x");
+            }
+        }
+    }
+}
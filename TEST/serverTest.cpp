@@ -1,9 +1,14 @@
 #include <gtest/gtest.h>
 #include <glog/logging.h>
+#include <sched.h>
 
 #include <ecv/net.h>
 #include "amrpc.h"
 
+#if FOLLY_HAS_COROUTINES
+#include <folly/experimental/coro/BlockingWait.h>
+#endif
+
 using namespace std;
 using namespace amrpc;
 
@@ -11,7 +16,7 @@ struct TestMsg {
     int int_num = 1;
     double double_num = 1.0;
     string str = "abcd";
-    AMRPC_DEFINE(int_num, double_num, str);
+    AMRPC_DEFINE_VIEW(int_num, double_num, str);
 };
 
 constexpr static string_view SERVER_ADDRESS = "ipc://amrpc_test.ipc";
@@ -119,6 +124,214 @@ TEST(rpc, errorConv) {
     ASSERT_EQ(res.status.code, (unsigned int) 500) << res.status.reason;
 }
 
+TEST(rpc, coalesce) {
+    constexpr static string_view METHOD = "/test";
+    constexpr static string_view RET = "rpc.coalesce";
+    amrpc::Server server(SERVER_ADDRESS);
+    atomic_int calls = {0};
+    server.AddRpc<string(int)>(METHOD, [&calls](int data) {
+        ++calls;
+        return folly::futures::sleep(chrono::milliseconds(200)).deferValue([](auto&&) {
+            return string(RET);
+        });
+    }, amrpc::RPC_COALESCE);
+    amrpc::RemoteFunction<string(int)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    vector<folly::SemiFuture<string>> futures;
+    for (int i = 0; i < 8; ++i) futures.emplace_back(func(1));
+    for (auto& res : folly::collectAll(move(futures)).get()) {
+        ASSERT_TRUE(res.hasValue());
+        ASSERT_EQ(res.value(), RET);
+    }
+    ASSERT_EQ(calls, 1);
+}
+
+TEST(rpc, cache) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    atomic_int calls = {0};
+    server.AddRpc<string(int)>(METHOD, [&calls](int data) {
+        ++calls;
+        return to_string(data);
+    });
+    amrpc::CacheOptions options;
+    options.ttl = chrono::seconds(10);
+    amrpc::CachedRemoteFunction<string(int)> func(SERVER_ADDRESS, METHOD, options);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    ASSERT_EQ(func(1).get(), "1");
+    ASSERT_EQ(func(1).get(), "1");
+    ASSERT_EQ(calls, 1);
+    ASSERT_EQ(func(2).get(), "2");
+    ASSERT_EQ(calls, 2);
+    func.Clear();
+    ASSERT_EQ(func(1).get(), "1");
+    ASSERT_EQ(calls, 3);
+}
+
+TEST(rpc, balance) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<string(int)>(METHOD, [](int data) {
+        return to_string(data);
+    });
+    amrpc::BalancedRemoteFunction<string(int)> func({string(SERVER_ADDRESS), "ipc://amrpc_test_missing.ipc"}, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    //the missing host is ejected after a few failures
+    for (int i = 0; i < 10; ++i) func(int(i)).wait();
+    for (int i = 0; i < 10; ++i) {
+        auto res = func(int(i)).wait();
+        ASSERT_TRUE(res.hasValue());
+        ASSERT_EQ(move(res).get(), to_string(i));
+    }
+}
+
+TEST(rpc, hedge) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    atomic_bool stalled = {false};
+    server.AddRpc<string(int)>(METHOD, [&stalled](int data) -> folly::SemiFuture<string> {
+        //only the first request of 20 stalls, its hedge does not
+        auto delay = data == 20 && !stalled.exchange(true) ? chrono::seconds(3) : chrono::seconds(0);
+        return folly::futures::sleep(delay).deferValue([data](auto&&) {
+            return to_string(data);
+        });
+    });
+    amrpc::BalanceOptions options;
+    options.hedge = true;
+    options.hedge_budget = 1;
+    options.hedge_min_samples = 20;
+    amrpc::BalancedRemoteFunction<string(int)> func({string(SERVER_ADDRESS)}, METHOD, options);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    for (int i = 0; i < 20; ++i) ASSERT_EQ(func(int(i)).get(), to_string(i));
+    auto start = chrono::steady_clock::now();
+    ASSERT_EQ(func(20).get(), "20");
+    ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(1));
+}
+
+TEST(rpc, inlineCompletion) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<TestMsg(int)>(METHOD, [](int data) {
+        TestMsg msg;
+        msg.int_num = data;
+        if (data > 1) msg.str = string(1024, 'a');
+        return msg;
+    });
+    amrpc::CompletionOptions completion;
+    completion.inline_threshold = 64;
+    amrpc::RemoteFunction<TestMsg(int)> func(SERVER_ADDRESS, METHOD, completion);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    //decoded inline
+    auto small = func(1).wait();
+    ASSERT_TRUE(small.hasValue());
+    ASSERT_EQ(small.value().int_num, 1);
+    //decoded on the amrpc executor
+    auto large = func(2).wait();
+    ASSERT_TRUE(large.hasValue());
+    ASSERT_EQ(large.value().str.size(), 1024);
+}
+
+TEST(rpc, lanes) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<string(string)>(METHOD, [](string&& data) {
+        return data;
+    }, amrpc::RPC_CONTROL);
+    amrpc::RemoteFunction<string(string)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    auto executed = amrpc::GetLaneStats(amrpc::PRIORITY_CONTROL).executed;
+    auto res = func(string("rpc.lanes")).wait();
+    ASSERT_TRUE(res.hasValue());
+    ASSERT_EQ(res.value(), "rpc.lanes");
+    ASSERT_GT(amrpc::GetLaneStats(amrpc::PRIORITY_CONTROL).executed, executed);
+}
+
+TEST(rpc, batch) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    atomic<size_t> batches = {0};
+    amrpc::BatchOptions options;
+    options.max_size = 4;
+    options.max_wait = chrono::milliseconds(10);
+    server.AddBatchRpc<int(int)>(METHOD, [&batches](vector<tuple<int>>&& requests) {
+        ++batches;
+        vector<int> results;
+        for (auto&[data] : requests) results.push_back(data * 2);
+        return results;
+    }, options);
+    amrpc::RemoteFunction<int(int)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    vector<folly::SemiFuture<int>> futures;
+    for (int i = 0; i < 8; ++i) futures.emplace_back(func(int(i)));
+    auto results = folly::collectAll(futures.begin(), futures.end()).get();
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_TRUE(results[i].hasValue());
+        ASSERT_EQ(results[i].value(), i * 2);
+    }
+    ASSERT_LT(batches, 8);
+}
+
+TEST(rpc, msgView) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<TestMsg(int)>(METHOD, [](int data) {
+        TestMsg msg;
+        msg.int_num = data;
+        msg.str = "abcde";
+        return msg;
+    });
+    amrpc::RemoteFunction<amrpc::MsgView<TestMsg>(int)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    auto res_future = func(2).wait();
+    ASSERT_TRUE(res_future.hasValue());
+    auto view = move(res_future).get();
+    ASSERT_EQ(view.Get<0>(), 2);
+    ASSERT_EQ(view.Get(&TestMsg::double_num), 1.0);
+    ASSERT_EQ(view.Get(&TestMsg::str), "abcde");
+    ASSERT_EQ(view.Materialize().str, "abcde");
+}
+
+#if FOLLY_HAS_COROUTINES
+TEST(rpc, coroutine) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<string(int)>(METHOD, [](int data) -> folly::coro::Task<string> {
+        co_return to_string(data);
+    });
+    amrpc::RemoteFunction<string(int)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    ASSERT_EQ(folly::coro::blockingWait(func.CoCall(2)), "2");
+}
+#endif
+
+TEST(rpc, inproc) {
+    constexpr static string_view METHOD = "/test";
+    constexpr static string_view INPROC_ADDRESS = "inproc://amrpc_test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.ServeInproc(INPROC_ADDRESS);
+    const int* sent = nullptr;
+    server.AddRpc<vector<int>(vector<int>)>(METHOD, [&sent](vector<int>&& data) {
+        //moved, not packed
+        EXPECT_EQ(data.data(), sent);
+        return move(data);
+    });
+    server.AddRpc<string(string)>("/text", [](string&& data) {
+        return data;
+    });
+    amrpc::RemoteFunction<vector<int>(vector<int>)> func(INPROC_ADDRESS, METHOD);
+    ASSERT_TRUE(func.Enabled().wait().hasValue());
+    vector<int> data{1, 2, 3};
+    sent = data.data();
+    auto res = func(move(data)).wait();
+    ASSERT_TRUE(res.hasValue());
+    ASSERT_EQ(res.value().data(), sent);
+    //other descriptions are packed
+    amrpc::RemoteFunction<string(string)> text(INPROC_ADDRESS, "/text");
+    ASSERT_EQ(text("abcd").get(), "abcd");
+    amrpc::RemoteFunction<string(string)> missing("inproc://amrpc_missing", "/text");
+    ASSERT_TRUE(missing.Enabled().wait().hasException());
+}
+
 TEST(publish, msg) {
     constexpr static string_view METHOD = "/test";
     amrpc::Server server(SERVER_ADDRESS);
@@ -144,6 +357,216 @@ TEST(publish, msg) {
     while (!continue_) /*wait for callbaack run*/;
 }
 
+TEST(publish, history) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    amrpc::HistoryOptions history;
+    history.max_messages = 2;
+    server.AddPublish<TestMsg>(METHOD, history);
+    for (int i = 0; i < 3; ++i) {
+        TestMsg msg;
+        msg.int_num = i;
+        server.Publish(METHOD, move(msg));
+    }
+    atomic<size_t> received = {0};
+    auto puller_future = amrpc::PullFrom<TestMsg>(SERVER_ADDRESS, METHOD, 0,
+                                                  [&received](folly::Try<TestMsg>&& t, uint64_t seq) {
+                                                      ASSERT_TRUE(t.hasValue());
+                                                      //seq 0 is dropped from the history
+                                                      EXPECT_EQ(seq, received + 1);
+                                                      EXPECT_EQ(static_cast<uint64_t>(t.value().int_num), seq);
+                                                      ++received;
+                                                  });
+    puller_future.wait();
+    ASSERT_TRUE(puller_future.hasValue());
+    auto puller = move(puller_future).get();
+    while (received < 2) /*wait for catch-up*/;
+    TestMsg msg;
+    msg.int_num = 3;
+    server.Publish(METHOD, move(msg));
+    while (received < 3) /*wait for live*/;
+}
+
+TEST(publish, delta) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    amrpc::DeltaOptions delta;
+    delta.keyframe_interval = 10;
+    server.AddPublish<TestMsg>(METHOD, delta);
+    TestMsg first;
+    first.int_num = 2;
+    first.str = "keyframe";
+    server.Publish(METHOD, move(first));
+    mutex mtx;
+    vector<TestMsg> received;
+    auto puller_future = amrpc::PullDelta<TestMsg>(SERVER_ADDRESS, METHOD, [&](folly::Try<TestMsg>&& t) {
+        ASSERT_TRUE(t.hasValue());
+        lock_guard<mutex> lock(mtx);
+        received.push_back(move(t).value());
+    });
+    puller_future.wait();
+    ASSERT_TRUE(puller_future.hasValue());
+    auto puller = move(puller_future).get();
+    auto count = [&]() {
+        lock_guard<mutex> lock(mtx);
+        return received.size();
+    };
+    //a new subscriber gets the last message
+    while (count() < 1) /*wait for keyframe*/;
+    TestMsg second;
+    second.int_num = 2;
+    second.double_num = 2.5;
+    second.str = "keyframe";
+    server.Publish(METHOD, move(second));
+    while (count() < 2) /*wait for delta*/;
+    lock_guard<mutex> lock(mtx);
+    EXPECT_EQ(received[0].str, "keyframe");
+    //unchanged fields are merged from the last message
+    EXPECT_EQ(received[1].int_num, 2);
+    EXPECT_EQ(received[1].double_num, 2.5);
+    EXPECT_EQ(received[1].str, "keyframe");
+}
+
+TEST(publish, shared) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddPublish<TestMsg>(METHOD);
+    atomic<size_t> received = {0};
+    auto callback = [&received](const folly::Try<TestMsg>& t) {
+        if (t.hasValue() && t.value().int_num == 2) ++received;
+    };
+    auto first = amrpc::PullShared<TestMsg>(SERVER_ADDRESS, METHOD, callback).wait();
+    auto second = amrpc::PullShared<TestMsg>(SERVER_ADDRESS, METHOD, callback).wait();
+    ASSERT_TRUE(first.hasValue());
+    ASSERT_TRUE(second.hasValue());
+    auto first_puller = move(first).get();
+    auto second_puller = move(second).get();
+    ASSERT_TRUE(first_puller.IsOpen());
+    //one stream on the server
+    ASSERT_EQ(server.GetPullerSize(METHOD), 1);
+    TestMsg msg;
+    msg.int_num = 2;
+    server.Publish(METHOD, move(msg));
+    while (received < 2) /*wait for both callbacks*/;
+}
+
+TEST(publish, inproc) {
+    constexpr static string_view METHOD = "/test";
+    constexpr static string_view INPROC_ADDRESS = "inproc://amrpc_test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.ServeInproc(INPROC_ADDRESS);
+    server.AddPublish<TestMsg>(METHOD);
+    atomic<int> last = {0};
+    auto puller = amrpc::PullShared<TestMsg>(INPROC_ADDRESS, METHOD, [&last](const folly::Try<TestMsg>& t) {
+        if (t.hasValue()) last = t.value().int_num;
+    }).wait();
+    ASSERT_TRUE(puller.hasValue());
+    ASSERT_TRUE(puller.value().IsOpen());
+    //no socket puller
+    ASSERT_EQ(server.GetPullerSize(METHOD), 0);
+    for (int i = 2; i <= 10; ++i) {
+        TestMsg msg;
+        msg.int_num = i;
+        server.Publish(METHOD, msg);
+    }
+    while (last != 10) /*in publish order*/;
+    server.Del(METHOD);
+    while (puller.value().IsOpen()) /*closed with the publish*/;
+}
+
+TEST(publish, prefix) {
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddPublish<string>("/prefix/a");
+    server.AddPublish<string>("/other");
+    server.ServePrefix("/prefix/*");
+    mutex mtx;
+    vector<string> methods;
+    auto puller_future = amrpc::PullPrefix<string>(SERVER_ADDRESS, "/prefix/*",
+                                                   [&](string_view method, folly::Try<string>&& t) {
+                                                       ASSERT_TRUE(t.hasValue());
+                                                       EXPECT_EQ(t.value(), "publish.prefix");
+                                                       lock_guard<mutex> lock(mtx);
+                                                       methods.emplace_back(method);
+                                                   });
+    puller_future.wait();
+    ASSERT_TRUE(puller_future.hasValue());
+    auto puller = move(puller_future).get();
+    //added after the subscription
+    server.AddPublish<string>("/prefix/b/c");
+    server.Publish("/prefix/a", string("publish.prefix"));
+    server.Publish("/prefix/b/c", string("publish.prefix"));
+    while (true) {
+        lock_guard<mutex> lock(mtx);
+        if (methods.size() == 2) break;
+    }
+    ASSERT_EQ(methods, (vector<string>{"/prefix/a", "/prefix/b/c"}));
+}
+
+TEST(server, capture) {
+    constexpr static string_view METHOD = "/test";
+    constexpr static string_view CAPTURE = "amrpc_test.cap";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddRpc<string(string)>(METHOD, [](string&& data) {
+        return data;
+    });
+    server.AddPublish<string>("/capture");
+    server.StartCapture(CAPTURE);
+    amrpc::RemoteFunction<string(string)> func(SERVER_ADDRESS, METHOD);
+    ASSERT_TRUE(func(string("capture.rpc")).wait().hasValue());
+    server.Publish("/capture", string("capture.publish"));
+    server.StopCapture();
+
+    amrpc::detail::CaptureReader reader(CAPTURE);
+    amrpc::detail::CaptureRecord record;
+    ASSERT_TRUE(reader.Next(record));
+    ASSERT_EQ(record.kind, amrpc::detail::CAPTURE_RPC);
+    ASSERT_EQ(record.method, METHOD);
+    ASSERT_EQ(record.payload, "capture.rpc");
+    ASSERT_TRUE(reader.Next(record));
+    ASSERT_EQ(record.kind, amrpc::detail::CAPTURE_PUBLISH);
+    ASSERT_EQ(record.type, amrpc::detail::TEXT);
+    ASSERT_EQ(record.payload, "capture.publish");
+    ASSERT_FALSE(reader.Next(record));
+}
+
+TEST(server, placement) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    ASSERT_EQ(sched_getaffinity(0, sizeof(set), &set), 0);
+    vector<int> allowed;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+    }
+    amrpc::PlacementOptions options;
+    options.amrpc_cpus = {allowed.back()};
+    amrpc::SetThreadPlacement(options);
+    auto threads = amrpc::GetThreadPlacement();
+    auto it = find_if(threads.begin(), threads.end(), [](auto& t) { return t.name == "amrpc_evb"; });
+    ASSERT_NE(it, threads.end());
+    EXPECT_EQ(it->cpus, vector<int>{allowed.back()});
+    EXPECT_EQ(it->cpu, allowed.back());
+    //give the executor back to the scheduler
+    options.amrpc_cpus = allowed;
+    amrpc::SetThreadPlacement(options);
+}
+
+TEST(publish, limit) {
+    constexpr static string_view METHOD = "/test";
+    amrpc::Server server(SERVER_ADDRESS);
+    server.AddPublish<string>(METHOD);
+    amrpc::PublishLimit limit;
+    limit.max_message_bytes = 4;
+    limit.policy = amrpc::BUDGET_REJECT;
+    server.SetPublishLimit(METHOD, limit);
+    server.Publish(METHOD, string("1234"));
+    ASSERT_THROW(server.Publish(METHOD, string("12345")), amrpc::Exception);
+    limit.policy = amrpc::BUDGET_DROP;
+    server.SetPublishLimit(METHOD, limit);
+    auto dropped = amrpc::GetMemoryUsage().dropped_publishes;
+    server.Publish(METHOD, string("12345"));
+    ASSERT_EQ(amrpc::GetMemoryUsage().dropped_publishes, dropped + 1);
+}
+
 TEST(publish, string) {
     constexpr static string_view METHOD = "/test";
     constexpr static string_view RET = "publish.string";
@@ -2,9 +2,24 @@
 #define AMRPC_AMRPC_INL_H
 
 #include <folly/futures/Future.h>
+#include <folly/futures/SharedPromise.h>
+#include <folly/executors/InlineExecutor.h>
+#include <folly/executors/SerialExecutor.h>
 #include <folly/dynamic.h>
 #include <folly/json.h>
 #include <msgpack.hpp>
+#include <array>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#if FOLLY_HAS_COROUTINES
+#include <folly/experimental/coro/AsyncGenerator.h>
+#include <folly/experimental/coro/Task.h>
+#include <folly/experimental/coro/UnboundedQueue.h>
+#endif
 #include "amrpc.h"
 
 /////////////////////////////////////////////////////////
@@ -16,6 +31,13 @@
     void amrpc_msg_tag(){ /*amrpc_msg_tag*/ }                           \
     MSGPACK_DEFINE_MAP(__VA_ARGS__);
 
+//AMRPC_DEFINE that can also be read through MsgView.
+//Plain members only, MSGPACK_BASE_MAP and MSGPACK_NVP entries do not compile here.
+#define AMRPC_DEFINE_VIEW(...)                                          \
+    auto amrpc_tie(){ return std::tie(__VA_ARGS__); }                   \
+    static constexpr std::string_view amrpc_names(){ return #__VA_ARGS__; } \
+    AMRPC_DEFINE(__VA_ARGS__)
+
 #define AMRPC_MOVE(MSG, KEY)                                            \
 ({                                                                      \
 if constexpr (amrpc::detail::is_amrpc_msg<decltype(MSG)>::value){       \
@@ -42,7 +64,7 @@ public:
 
     Bytes(const char* data, size_t size) : std::string(data, size) {}
 
-    explicit Bytes(std::string&& data) : std::string(data) {}
+    explicit Bytes(std::string&& data) : std::string(std::move(data)) {}
 
     explicit Bytes(std::string_view view) : std::string(view) {}
 };
@@ -68,10 +90,65 @@ template<class T>
 struct is_amrpc_msg<T, std::void_t<decltype(std::declval<T&>().amrpc_msg_tag())>> : std::true_type {
 };
 
+//Defined with AMRPC_DEFINE_VIEW
+template<class T, class = void>
+struct is_amrpc_view_msg : std::false_type {
+};
+
+template<class T>
+struct is_amrpc_view_msg<T, std::void_t<decltype(std::declval<T&>().amrpc_tie())>> : is_amrpc_msg<T> {
+};
+
+template<typename T>
+struct is_msg_view : std::false_type {
+};
+
+template<typename T>
+struct is_msg_view<MsgView<T>> : std::true_type {
+};
+
+//Views into the caller's buffers
+template<typename T>
+inline constexpr bool is_view_v = std::is_same_v<T, std::string_view> || std::is_same_v<T, BytesView> ||
+                                  is_msg_view<T>::value;
+
+//Field type as returned by MsgView
+template<typename F, typename = void>
+struct view_of {
+    using type = F;
+};
+
+template<>
+struct view_of<std::string> {
+    using type = std::string_view;
+};
+
+template<>
+struct view_of<Bytes> {
+    using type = BytesView;
+};
+
+template<typename F>
+struct view_of<F, std::enable_if_t<is_amrpc_view_msg<F>::value>> {
+    using type = MsgView<F>;
+};
+
+template<typename F>
+using view_of_t = typename view_of<F>::type;
+
 inline bool MsgpackUnpackRef(msgpack::type::object_type, std::size_t, void*) {
     return true;
 }
 
+//Unpack by reference, the raw buffer is moved into the zone and lives as long as the handle
+inline std::shared_ptr<msgpack::object_handle> UnpackHandle(std::string&& raw) {
+    auto zone = std::make_unique<msgpack::zone>();
+    auto buffer = std::make_unique<std::string>(std::move(raw));
+    auto obj = msgpack::unpack(*zone, buffer->data(), buffer->size(), MsgpackUnpackRef);
+    zone->push_finalizer(std::move(buffer));
+    return std::make_shared<msgpack::object_handle>(obj, std::move(zone));
+}
+
 template<typename, typename = std::void_t<> >
 struct get_type {
     using type = void;
@@ -144,6 +221,397 @@ struct DescriptionTrait {
 
 };
 
+//Callback returning folly::coro::Task<R> instead of a future
+template<typename Desc, typename Callback, typename = void>
+struct is_task_callback : std::false_type {
+};
+
+//Adapts a coroutine callback to DescriptionTrait<Desc>::Func
+template<typename Desc>
+struct TaskAdapter;
+
+#if FOLLY_HAS_COROUTINES
+template<typename R, typename... Args, typename Callback>
+struct is_task_callback<R(Args...), Callback,
+    std::enable_if_t<std::is_same_v<std::invoke_result_t<Callback, Args...>, folly::coro::Task<R>>>>
+    : std::true_type {
+};
+
+template<typename R, typename... Args>
+struct TaskAdapter<R(Args...)> {
+    //the task starts after the request buffer of a view argument is gone
+    static_assert(!(is_view_v<std::decay_t<Args>> || ...),
+                  "coroutine rpc can not take std::string_view, BytesView or MsgView arguments");
+
+    //args are moved into the coroutine frame, the callback is kept alive by the running task
+    template<typename Callback>
+    static folly::coro::Task<R> Invoke(std::shared_ptr<Callback> cb, Args... args) {
+        co_return co_await (*cb)(std::move(args)...);
+    }
+
+    template<typename Callback>
+    static std::function<folly::SemiFuture<R>(Args...)> Wrap(Callback&& cb) {
+        auto shared = std::make_shared<std::decay_t<Callback>>(std::forward<Callback>(cb));
+        return [shared](Args... args) {
+            return Invoke(shared, std::move(args)...).semi();
+        };
+    }
+};
+#endif
+
+template<typename R>
+R UnpackMsg(std::string&& raw) {
+    auto oh = UnpackHandle(std::move(raw));
+    if constexpr (is_msg_view<R>::value) {
+        return R(std::move(oh));
+    } else {
+        R ret = oh->get().as<R>();
+        if constexpr (is_amrpc_msg<R>::value) ret.amrpc_oh = std::move(oh);
+        return ret;
+    }
+}
+
+//sbuffer starts at 8k, most messages are far smaller
+constexpr std::size_t PACK_INIT_SIZE = 256;
+
+//msgpack stream writing straight into a string
+struct StringBuffer {
+    std::string data;
+
+    void write(const char* buf, std::size_t len) { data.append(buf, len); }
+};
+
+template<typename T>
+std::string PackToString(const T& v) {
+    StringBuffer buffer;
+    buffer.data.reserve(PACK_INIT_SIZE);
+    msgpack::pack(buffer, v);
+    return std::move(buffer.data);
+}
+
+//Same bytes as RemoteFunction sends for msgpack rpc
+template<typename... Args>
+std::string PackArgs(const Args& ... args) {
+    return PackToString(std::tie(args...));
+}
+
+//How a RemoteFunction signature is put on the wire
+template<typename Sig>
+struct Codec;
+
+template<typename R, typename... Args>
+struct Codec<R(Args...)> {
+    static constexpr MessageType TYPE = MSGPACK;
+
+    static std::string Encode(Args&& ... args) { return PackArgs(args...); }
+
+    static R Decode(std::string&& raw) { return UnpackMsg<R>(std::move(raw)); }
+};
+
+template<>
+struct Codec<std::string(std::string)> {
+    static constexpr MessageType TYPE = TEXT;
+
+    static std::string Encode(std::string&& arg) { return std::move(arg); }
+
+    static std::string Decode(std::string&& raw) { return std::move(raw); }
+};
+
+template<>
+struct Codec<Bytes(Bytes)> {
+    static constexpr MessageType TYPE = BIN;
+
+    static std::string Encode(Bytes&& arg) { return std::move(arg); }
+
+    static Bytes Decode(std::string&& raw) { return Bytes(std::move(raw)); }
+};
+
+template<>
+struct Codec<Bytes(BytesView)> {
+    static constexpr MessageType TYPE = BIN;
+
+    static std::string Encode(BytesView&& arg) { return std::string(arg); }
+
+    static Bytes Decode(std::string&& raw) { return Bytes(std::move(raw)); }
+};
+
+//The handler of AddRpc as called by inproc:// RemoteFunction, arguments are moved to the lane of the rpc
+template<typename Desc>
+struct InprocTyped;
+
+template<typename R, typename... Args>
+struct InprocTyped<R(Args...)> {
+    using Func = std::function<folly::SemiFuture<R>(Args...)>;
+
+    //null when an argument is a view, it would not outlive the caller
+    static std::shared_ptr<const void> Wrap(const Func& func, folly::Executor* executor) {
+        if constexpr ((is_view_v<std::decay_t<Args>> || ...)) {
+            return nullptr;
+        } else {
+            return std::make_shared<const Func>([func, executor](Args... args) {
+                return folly::via(executor, [func, args = std::make_tuple(std::move(args)...)]() mutable {
+                    return std::apply(func, std::move(args));
+                }).semi();
+            });
+        }
+    }
+};
+
+/////////////////////////////////////////////////////////
+// ResponseCache
+// lru list + index, concurrent misses of one key share a single call.
+/////////////////////////////////////////////////////////
+template<typename R>
+class ResponseCache : public std::enable_shared_from_this<ResponseCache<R>> {
+public:
+    explicit ResponseCache(const CacheOptions& options) : options_(options) {}
+
+    template<typename Fetch>
+    folly::SemiFuture<R> Get(std::string&& key, Fetch&& fetch);
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index_.clear();
+        lru_.clear();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    using Flight = std::shared_ptr<folly::SharedPromise<R>>;
+
+    struct Entry {
+        std::string key;
+        std::optional<R> value;
+        Clock::time_point time;
+        Flight flight;
+    };
+
+    void Complete(const std::string& key, const Flight& flight, folly::Try<R>&& t);
+
+    CacheOptions options_;
+    std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string_view, typename std::list<Entry>::iterator> index_;
+};
+
+template<typename R>
+template<typename Fetch>
+folly::SemiFuture<R> ResponseCache<R>::Get(std::string&& key, Fetch&& fetch) {
+    auto now = Clock::now();
+    Flight flight;
+    std::optional<R> stale;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            auto entry = it->second;
+            lru_.splice(lru_.begin(), lru_, entry);
+            if (entry->value && now < entry->time + options_.ttl)
+                return folly::makeSemiFuture(R(*entry->value));
+            if (entry->value && now < entry->time + options_.ttl + options_.stale)
+                stale.emplace(*entry->value);
+            if (entry->flight) {
+                if (stale) return folly::makeSemiFuture(std::move(*stale));
+                return entry->flight->getSemiFuture();
+            }
+            flight = entry->flight = std::make_shared<folly::SharedPromise<R>>();
+        } else {
+            lru_.push_front(Entry{key, std::nullopt, now, std::make_shared<folly::SharedPromise<R>>()});
+            flight = lru_.front().flight;
+            index_.emplace(lru_.front().key, lru_.begin());
+            while (index_.size() > options_.capacity) {
+                index_.erase(lru_.back().key);
+                lru_.pop_back();
+            }
+        }
+    }
+
+    auto res = stale ? folly::makeSemiFuture(std::move(*stale)) : flight->getSemiFuture();
+    folly::makeSemiFutureWith(std::forward<Fetch>(fetch))
+        .via(&GetAmrpcExecutor())
+        .thenTry([self = this->shared_from_this(), key{std::move(key)}, flight](folly::Try<R>&& t) {
+            self->Complete(key, flight, std::move(t));
+        });
+    return res;
+}
+
+template<typename R>
+void ResponseCache<R>::Complete(const std::string& key, const Flight& flight, folly::Try<R>&& t) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        //entry may be evicted or cleared while fetching
+        if (it != index_.end() && it->second->flight == flight) {
+            auto entry = it->second;
+            entry->flight.reset();
+            if (t.hasValue()) {
+                entry->value.emplace(t.value());
+                entry->time = Clock::now();
+            } else if (!entry->value) {
+                index_.erase(it);
+                lru_.erase(entry);
+            }
+        }
+    }
+    flight->setTry(std::move(t));
+}
+
+}//detail
+
+/////////////////////////////////////////////////////////
+// MsgView
+/////////////////////////////////////////////////////////
+template<typename T>
+class MsgView {
+    static_assert(detail::is_amrpc_view_msg<T>::value, "MsgView is only for AMRPC_DEFINE_VIEW struct");
+
+public:
+    using Fields = decltype(std::declval<T&>().amrpc_tie());
+    static constexpr std::size_t SIZE = std::tuple_size_v<Fields>;
+
+    template<std::size_t I>
+    using FieldType = std::remove_reference_t<std::tuple_element_t<I, Fields>>;
+
+    MsgView() = default;
+
+    explicit MsgView(std::shared_ptr<msgpack::object_handle> oh) : MsgView(oh, oh->get()) {}
+
+    //a nested message, oh owns root
+    MsgView(std::shared_ptr<msgpack::object_handle> oh, const msgpack::object& root);
+
+    //I-th field in AMRPC_DEFINE, string & Bytes are views into the received buffer.
+    //Missing fields are the default value of T.
+    template<std::size_t I>
+    detail::view_of_t<FieldType<I>> Get() const {
+        return Decode(fields_[I], std::get<I>(Defaults().amrpc_tie()));
+    }
+
+    //view.Get(&Msg::field)
+    template<typename M>
+    detail::view_of_t<M> Get(M T::* member) const {
+        return Decode(fields_.at(IndexOf(member)), Defaults().*member);
+    }
+
+    //decode all fields
+    [[nodiscard]] T Materialize() const {
+        if (!root_) return T();
+        T ret = root_->as<T>();
+        ret.amrpc_oh = oh_;
+        return ret;
+    }
+
+private:
+    static T& Defaults() {
+        static T defaults;
+        return defaults;
+    }
+
+    static const std::array<std::string_view, SIZE>& Names();
+
+    template<typename M>
+    static std::size_t IndexOf(M T::* member);
+
+    template<typename F>
+    detail::view_of_t<F> Decode(const msgpack::object* o, const F& def) const;
+
+    std::shared_ptr<msgpack::object_handle> oh_;
+    const msgpack::object* root_ = nullptr;
+    std::array<const msgpack::object*, SIZE> fields_{};
+};
+
+template<typename T>
+MsgView<T>::MsgView(std::shared_ptr<msgpack::object_handle> oh, const msgpack::object& root)
+    : oh_(std::move(oh)), root_(&root) {
+    if (root.type != msgpack::type::MAP) throw msgpack::type_error();
+    auto& names = Names();
+    for (uint32_t k = 0; k < root.via.map.size; ++k) {
+        auto& kv = root.via.map.ptr[k];
+        if (kv.key.type != msgpack::type::STR) continue;
+        std::string_view key(kv.key.via.str.ptr, kv.key.via.str.size);
+        //fields are packed in declaration order by amrpc itself
+        if (k < SIZE && names[k] == key) {
+            fields_[k] = &kv.val;
+            continue;
+        }
+        for (std::size_t i = 0; i < SIZE; ++i) {
+            if (names[i] == key) {
+                fields_[i] = &kv.val;
+                break;
+            }
+        }
+    }
+}
+
+template<typename T>
+const std::array<std::string_view, MsgView<T>::SIZE>& MsgView<T>::Names() {
+    static const auto names = [] {
+        std::array<std::string_view, SIZE> res{};
+        std::string_view all = T::amrpc_names();
+        for (auto& name : res) {
+            auto end = all.find(',');
+            name = all.substr(0, end);
+            all = end == std::string_view::npos ? std::string_view() : all.substr(end + 1);
+            name.remove_prefix(std::min(name.find_first_not_of(' '), name.size()));
+            name.remove_suffix(name.size() - std::min(name.find_last_not_of(' ') + 1, name.size()));
+        }
+        return res;
+    }();
+    return names;
+}
+
+template<typename T>
+template<typename M>
+std::size_t MsgView<T>::IndexOf(M T::* member) {
+    auto& defaults = Defaults();
+    const void* target = &(defaults.*member);
+    std::size_t index = SIZE, i = 0;
+    std::apply([&](auto& ... fields) {
+        ((index = static_cast<const void*>(&fields) == target ? i : index, ++i), ...);
+    }, defaults.amrpc_tie());
+    if (index == SIZE) throw Exception("MsgView: member is not in AMRPC_DEFINE_VIEW");
+    return index;
+}
+
+template<typename T>
+template<typename F>
+detail::view_of_t<F> MsgView<T>::Decode(const msgpack::object* o, const F& def) const {
+    if constexpr (detail::is_amrpc_view_msg<F>::value) {
+        return o ? MsgView<F>(oh_, *o) : MsgView<F>();
+    } else if constexpr (detail::is_amrpc_msg<F>::value) {
+        if (!o) return def;
+        F ret = o->as<F>();
+        ret.amrpc_oh = oh_;
+        return ret;
+    } else if constexpr (std::is_same_v<F, std::string>) {
+        if (!o) return def;
+        if (o->type != msgpack::type::STR && o->type != msgpack::type::BIN) throw msgpack::type_error();
+        return std::string_view(o->via.str.ptr, o->via.str.size);
+    } else if constexpr (std::is_same_v<F, Bytes>) {
+        return o ? o->as<BytesView>() : BytesView(def.data(), def.size());
+    } else {
+        return o ? o->as<F>() : def;
+    }
+}
+
+/////////////////////////////////////////////////////////
+// RawRemoteFunction
+/////////////////////////////////////////////////////////
+namespace detail {
+inline folly::SemiFuture<folly::Unit> RawRemoteFunction::Enabled() {
+    if (IsInproc(host_)) {
+        return folly::makeSemiFutureWith([this]() { FindInproc(host_); });
+    }
+    return NetEnabled();
+}
+
+inline folly::SemiFuture<std::string> RawRemoteFunction::RawCall(MessageType type, std::string_view data) const {
+    if (IsInproc(host_)) {
+        return folly::makeSemiFutureWith([this, type, data]() {
+            return FindInproc(host_)->Call(method_, type, std::string(data));
+        });
+    }
+    return NetCall(type, data);
+}
 }//detail
 
 /////////////////////////////////////////////////////////
@@ -151,18 +619,31 @@ struct DescriptionTrait {
 /////////////////////////////////////////////////////////
 template<typename R, typename... Args>
 folly::SemiFuture<R> RemoteFunction<R(Args...)>::operator()(Args&& ... args) const {
-    auto buffer = std::make_shared<msgpack::sbuffer>();
-    msgpack::pack(*buffer, std::make_tuple(std::forward<Args>(args)...));
-    return folly::makeSemiFutureWith([this, buffer]() {
-        return RawCall(detail::MessageType::MSGPACK, std::string_view{buffer->data(), buffer->size()});
+    if (detail::IsInproc(host_)) {
+        //the server's handler is called with the arguments when its description is the same, packed otherwise.
+        //Its reply needs no decoding, so it is completed in the server's lane and completion_ is not used.
+        auto typed = folly::makeTryWith([this]() {
+            return detail::FindInproc(host_)->Typed(method_, typeid(R(Args...)));
+        });
+        if (typed.hasException()) return folly::makeSemiFuture<R>(std::move(typed).exception());
+        if (*typed) {
+            auto& func = *std::static_pointer_cast<const typename detail::InprocTyped<R(Args...)>::Func>(*typed);
+            return func(std::forward<Args>(args)...);
+        }
+    }
+    auto data = std::make_shared<std::string>(detail::PackArgs(args...));
+    auto executor = completion_.executor ? completion_.executor : &detail::GetAmrpcExecutor();
+    return folly::makeSemiFutureWith([this, data]() {
+        return RawCall(detail::MessageType::MSGPACK, *data);
     })
-        .via(&detail::GetAmrpcExecutor())
-        .thenValue([buffer](std::string&& raw) -> R {
-            auto oh = std::make_shared<msgpack::object_handle>();
-            msgpack::unpack(*oh, raw.data(), raw.size(), detail::MsgpackUnpackRef);
-            R ret = oh->get().as<R>();
-            if constexpr (amrpc::detail::is_amrpc_msg<R>::value) ret.amrpc_oh = oh;
-            return ret;
+        .via(&folly::InlineExecutor::instance())
+        .thenValue([data, executor, threshold = completion_.inline_threshold](std::string&& raw) {
+            if (raw.size() <= threshold) {
+                return folly::makeFutureWith([&raw]() { return detail::UnpackMsg<R>(std::move(raw)); });
+            }
+            return folly::via(executor, [raw{std::move(raw)}]() mutable {
+                return detail::UnpackMsg<R>(std::move(raw));
+            });
         }).semi();
 }
 
@@ -171,18 +652,80 @@ inline folly::SemiFuture<std::string> RemoteFunction<std::string(std::string)>::
     return RawCall(detail::MessageType::TEXT, args);
 }
 
+//Bytes needs no decoding, the caller's executor picks up the reply directly
 template<>
 inline folly::SemiFuture<Bytes> RemoteFunction<Bytes(BytesView)>::operator()(BytesView&& args) const {
-    return RawCall(detail::MessageType::BIN, args).via(&detail::GetAmrpcExecutor()).thenValue([](std::string&& raw) {
+    return RawCall(detail::MessageType::BIN, args).deferValue([](std::string&& raw) {
         return Bytes(std::move(raw));
-    }).semi();
+    });
 }
 
 template<>
 inline folly::SemiFuture<Bytes> RemoteFunction<Bytes(Bytes)>::operator()(Bytes&& args) const {
-    return RawCall(detail::MessageType::BIN, args).via(&detail::GetAmrpcExecutor()).thenValue([](std::string&& raw) {
+    return RawCall(detail::MessageType::BIN, args).deferValue([](std::string&& raw) {
         return Bytes(std::move(raw));
-    }).semi();
+    });
+}
+
+#if FOLLY_HAS_COROUTINES
+template<typename R, typename... Args>
+folly::coro::Task<R> RemoteFunction<R(Args...)>::CoCall(Args... args) const {
+    using Codec = detail::Codec<R(Args...)>;
+    auto data = Codec::Encode(std::move(args)...);
+    auto raw = co_await RawCall(Codec::TYPE, data);
+    co_return Codec::Decode(std::move(raw));
+}
+#endif
+
+/////////////////////////////////////////////////////////
+// CachedRemoteFunction
+/////////////////////////////////////////////////////////
+template<typename R, typename... Args>
+CachedRemoteFunction<R(Args...)>::CachedRemoteFunction(const std::string_view& host, const std::string_view& method,
+                                                       const CacheOptions& options)
+    : RemoteFunction<R(Args...)>(host, method), cache_(std::make_shared<detail::ResponseCache<R>>(options)) {}
+
+template<typename R, typename... Args>
+folly::SemiFuture<R> CachedRemoteFunction<R(Args...)>::operator()(Args&& ... args) const {
+    using Codec = detail::Codec<R(Args...)>;
+    //the key is exactly the request body
+    auto data = std::make_shared<std::string>(Codec::Encode(std::forward<Args>(args)...));
+    return cache_->Get(std::string(*data), [this, data]() {
+        return this->RawCall(Codec::TYPE, *data)
+            .via(&detail::GetAmrpcExecutor())
+            .thenValue([data](std::string&& raw) -> R {
+                return Codec::Decode(std::move(raw));
+            }).semi();
+    });
+}
+
+template<typename R, typename... Args>
+void CachedRemoteFunction<R(Args...)>::Clear() {
+    cache_->Clear();
+}
+
+/////////////////////////////////////////////////////////
+// BalancedRemoteFunction
+/////////////////////////////////////////////////////////
+template<typename R, typename... Args>
+BalancedRemoteFunction<R(Args...)>::BalancedRemoteFunction(std::vector<std::string> hosts, std::string_view method,
+                                                           const BalanceOptions& options)
+    : balancer_(std::move(hosts), method, options) {}
+
+template<typename R, typename... Args>
+folly::SemiFuture<folly::Unit> BalancedRemoteFunction<R(Args...)>::Enabled() {
+    return balancer_.Enabled();
+}
+
+template<typename R, typename... Args>
+folly::SemiFuture<R> BalancedRemoteFunction<R(Args...)>::operator()(Args&& ... args) const {
+    using Codec = detail::Codec<R(Args...)>;
+    auto data = Codec::Encode(std::forward<Args>(args)...);
+    return balancer_.Call(Codec::TYPE, std::move(data))
+        .via(&detail::GetAmrpcExecutor())
+        .thenValue([](std::string&& raw) -> R {
+            return Codec::Decode(std::move(raw));
+        }).semi();
 }
 
 /////////////////////////////////////////////////////////
@@ -193,15 +736,9 @@ folly::SemiFuture<detail::Puller>
 Pull(std::string_view host, std::string_view method, std::function<void(folly::Try<MSG>&&)>&& func) {
     return detail::Puller::Create(detail::MessageType::MSGPACK, host, method,
                                   [func{std::move(func)}](folly::Try<std::string>&& raw_try) {
-                                      folly::makeSemiFuture(move(raw_try)).deferValue([](std::string&& raw) {
-                                          auto oh = std::make_shared<msgpack::object_handle>();
-                                          msgpack::unpack(*oh, raw.data(), raw.size(), detail::MsgpackUnpackRef);
-                                          auto ret = oh->get().as<MSG>();
-                                          if constexpr (amrpc::detail::is_amrpc_msg<MSG>::value) ret.amrpc_oh = oh;
-                                          return ret;
-                                      }).defer([&func](folly::Try<MSG>&& try_msg) {
-                                          func(std::move(try_msg));
-                                      }).get();
+                                      func(folly::makeTryWith([&raw_try]() {
+                                          return detail::UnpackMsg<MSG>(std::move(raw_try).value());
+                                      }));
                                   });
 }
 
@@ -217,67 +754,496 @@ inline folly::SemiFuture<detail::Puller>
 Pull<Bytes>(std::string_view host, std::string_view method, std::function<void(folly::Try<Bytes>&&)>&& func) {
     return detail::Puller::Create(detail::MessageType::BIN, host, method,
                                   [f{std::move(func)}](folly::Try<std::string>&& raw_try) {
-                                      folly::makeSemiFuture(std::move(raw_try)).deferValue([](std::string&& raw) {
-                                          return Bytes(std::move(raw));
-                                      }).defer([&](folly::Try<Bytes>&& b_try) {
-                                          f(std::move(b_try));
-                                      }).get();
+                                      f(folly::makeTryWith([&raw_try]() {
+                                          return Bytes(std::move(raw_try).value());
+                                      }));
+                                  });
+}
+
+/////////////////////////////////////////////////////////
+// PullShared
+/////////////////////////////////////////////////////////
+namespace detail {
+template<typename MSG>
+class SharedStream : public std::enable_shared_from_this<SharedStream<MSG>> {
+public:
+    using Callback = std::function<void(const folly::Try<MSG>&)>;
+
+    //The open stream of (host, method), a new one if there is none
+    static std::shared_ptr<SharedStream> Get(std::string_view host, std::string_view method) {
+        static std::mutex mutex;
+        static std::map<std::pair<std::string, std::string>, std::weak_ptr<SharedStream>> streams;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& weak = streams[{std::string(host), std::string(method)}];
+        if (auto stream = weak.lock(); stream && !stream->closed_) return stream;
+        auto stream = std::make_shared<SharedStream>();
+        weak = stream;
+        //expired entries are dropped on the next miss
+        for (auto it = streams.begin(); it != streams.end();) {
+            it = it->second.expired() ? streams.erase(it) : std::next(it);
+        }
+        stream->Open(host, method);
+        return stream;
+    }
+
+    folly::SemiFuture<folly::Unit> Opened() {
+        return opened_.getSemiFuture();
+    }
+
+    uint64_t Add(Callback&& func) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto callbacks = std::make_shared<Callbacks>(*callbacks_);
+        callbacks->emplace_back(++last_id_, std::make_shared<const Callback>(std::move(func)));
+        callbacks_ = std::move(callbacks);
+        return last_id_;
+    }
+
+    void Remove(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto callbacks = std::make_shared<Callbacks>();
+        for (auto& callback : *callbacks_) {
+            if (callback.first != id) callbacks->push_back(callback);
+        }
+        callbacks_ = std::move(callbacks);
+    }
+
+    [[nodiscard]] bool IsOpen() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !closed_ && (inproc_ || (puller_ && puller_->IsOpen()));
+    }
+
+private:
+    using Callbacks = std::vector<std::pair<uint64_t, std::shared_ptr<const Callback>>>;
+
+    void Open(std::string_view host, std::string_view method) {
+        std::weak_ptr<SharedStream> weak = this->shared_from_this();
+        //opened_ is fulfilled after unlocking, its continuations may add, remove or check the stream
+        if (IsInproc(host)) {
+            folly::Try<std::shared_ptr<void>> t = folly::makeTryWith([&]() {
+                return FindInproc(host)->Subscribe(method, Subscriber(weak));
+            });
+            SetOpened(std::move(t));
+            return;
+        }
+        Pull<MSG>(host, method, [weak](folly::Try<MSG>&& t) {
+            if (auto self = weak.lock()) self->Dispatch(t);
+        }).via(&GetAmrpcExecutor()).thenTry([self = this->shared_from_this()](folly::Try<Puller>&& t) {
+            self->SetOpened(std::move(t));
+        });
+    }
+
+    template<typename T>
+    void SetOpened(folly::Try<T>&& t) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (t.hasException()) {
+                closed_ = true;
+            } else if constexpr (std::is_same_v<T, Puller>) {
+                puller_.emplace(std::move(t).value());
+            } else {
+                inproc_ = std::move(t).value();
+            }
+        }
+        if (t.hasException()) opened_.setException(t.exception());
+        else opened_.setValue();
+    }
+
+    //Messages of a same-process server, handed over in publish order on the amrpc executor.
+    //A message published as MSG is copied instead of packed and decoded.
+    static InprocSubscriber Subscriber(const std::weak_ptr<SharedStream>& weak) {
+        auto serial = folly::SerialExecutor::create(folly::getKeepAliveToken(GetAmrpcExecutor()));
+        InprocSubscriber subscriber;
+        if constexpr (std::is_copy_constructible_v<MSG>) {
+            subscriber.type = typeid(MSG);
+            subscriber.typed = [weak, serial](const void* msg) {
+                serial->add([weak, msg = *static_cast<const MSG*>(msg)]() mutable {
+                    if (auto self = weak.lock()) self->Dispatch(folly::Try<MSG>(std::move(msg)));
+                });
+            };
+        }
+        subscriber.raw = [weak, serial](folly::Try<std::string>&& raw) {
+            serial->add([weak, raw = std::move(raw)]() mutable {
+                auto self = weak.lock();
+                if (!self) return;
+                self->Dispatch(folly::makeTryWith([&raw]() {
+                    if constexpr (std::is_same_v<MSG, std::string>) return std::move(raw).value();
+                    else if constexpr (std::is_same_v<MSG, Bytes>) return Bytes(std::move(raw).value());
+                    else return UnpackMsg<MSG>(std::move(raw).value());
+                }));
+            });
+        };
+        return subscriber;
+    }
+
+    //callbacks run on a snapshot, subscribing and unsubscribing never block the stream
+    void Dispatch(const folly::Try<MSG>& t) {
+        std::shared_ptr<const Callbacks> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (t.hasException()) closed_ = true;
+            callbacks = callbacks_;
+        }
+        for (auto& callback : *callbacks) (*callback.second)(t);
+    }
+
+    mutable std::mutex mutex_;
+    std::shared_ptr<const Callbacks> callbacks_ = std::make_shared<Callbacks>();
+    uint64_t last_id_ = 0;
+    //also read by Get without mutex_
+    std::atomic<bool> closed_ = false;
+    std::optional<Puller> puller_;
+    //subscription to a same-process server instead of puller_
+    std::shared_ptr<void> inproc_;
+    folly::SharedPromise<folly::Unit> opened_;
+};
+}//detail
+
+template<typename MSG>
+SharedPuller<MSG>::SharedPuller(std::shared_ptr<detail::SharedStream<MSG>> stream, uint64_t id) noexcept
+    : stream_(std::move(stream)), id_(id) {}
+
+template<typename MSG>
+SharedPuller<MSG>::SharedPuller(SharedPuller&& rhs) noexcept
+    : stream_(std::move(rhs.stream_)), id_(rhs.id_) {}
+
+template<typename MSG>
+SharedPuller<MSG>& SharedPuller<MSG>::operator=(SharedPuller&& rhs) noexcept {
+    if (this != &rhs) {
+        if (stream_) stream_->Remove(id_);
+        stream_ = std::move(rhs.stream_);
+        id_ = rhs.id_;
+    }
+    return *this;
+}
+
+template<typename MSG>
+SharedPuller<MSG>::~SharedPuller() {
+    if (stream_) stream_->Remove(id_);
+}
+
+template<typename MSG>
+bool SharedPuller<MSG>::IsOpen() const {
+    return stream_ && stream_->IsOpen();
+}
+
+template<typename MSG>
+folly::SemiFuture<SharedPuller<MSG>>
+PullShared(std::string_view host, std::string_view method, std::function<void(const folly::Try<MSG>&)>&& func) {
+    auto stream = detail::SharedStream<MSG>::Get(host, method);
+    SharedPuller<MSG> puller(stream, stream->Add(std::move(func)));
+    //a failed open drops the subscription with the handle
+    return stream->Opened().deferValue([puller{std::move(puller)}](folly::Unit) mutable {
+        return std::move(puller);
+    });
+}
+
+namespace detail {
+//Reply of the history rpc, messages are in seq order
+struct HistoryBatch {
+    //seq of the next message to be published
+    uint64_t next = 0;
+    std::vector<uint64_t> seqs;
+    std::vector<Bytes> payloads;
+    AMRPC_DEFINE(next, seqs, payloads);
+};
+
+//Reply of the keyframe rpc, seq 0 before the first message
+struct Keyframe {
+    uint64_t seq = 0;
+    Bytes message;
+    AMRPC_DEFINE(seq, message);
+};
+
+//Decode a publish payload carried inside an envelope
+template<typename MSG>
+MSG DecodePublish(std::string&& raw) {
+    if constexpr (std::is_same_v<MSG, std::string>) {
+        return std::move(raw);
+    } else if constexpr (std::is_same_v<MSG, folly::dynamic>) {
+        return folly::parseJson(raw);
+    } else if constexpr (std::is_same_v<MSG, Bytes>) {
+        return Bytes(std::move(raw));
+    } else {
+        return UnpackMsg<MSG>(std::move(raw));
+    }
+}
+
+//Json2Msgpack for a message of type T, the base64 strings of its Bytes fields are packed as BIN
+template<typename T>
+std::string JsonToMsgpack(std::string_view json) {
+    auto oh = UnpackHandle(JsonToMsgpack(json));
+    JsonBytesScope scope;
+    return PackToString(oh->get().as<T>());
+}
+
+//The lane of an rpc added with flags
+inline folly::Executor& GetRpcExecutor(unsigned int flags) {
+    return GetLaneExecutor(flags & RPC_CONTROL ? PRIORITY_CONTROL : (flags & RPC_BULK ? PRIORITY_BULK : PRIORITY_NORMAL));
+}
+
+//Channel carrying every publish under prefix, "/market/*" and "/market/" are the same prefix
+inline std::string PrefixMethod(std::string_view prefix) {
+    if (!prefix.empty() && prefix.back() == '*') prefix.remove_suffix(1);
+    std::string channel = "/amrpc/prefix";
+    channel += prefix;
+    if (channel.back() != '/') channel.push_back('/');
+    return channel;
+}
+
+//method is published on the prefix channel
+inline bool UnderPrefix(std::string_view method, std::string_view channel) {
+    return method.rfind(channel.substr(std::string_view("/amrpc/prefix").size()), 0) == 0;
+}
+}//detail
+
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullFrom(std::string_view host, std::string_view method, uint64_t from,
+         std::function<void(folly::Try<MSG>&&, uint64_t seq)>&& func) {
+    return detail::PullHistory(host, method, from,
+                               [func{std::move(func)}](folly::Try<std::string>&& raw_try, uint64_t seq) {
+                                   func(folly::makeTryWith([&raw_try]() {
+                                       return detail::DecodePublish<MSG>(std::move(raw_try).value());
+                                   }), seq);
+                               });
+}
+
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullDelta(std::string_view host, std::string_view method, std::function<void(folly::Try<MSG>&&)>&& func) {
+    static_assert(detail::is_amrpc_msg<MSG>::value || detail::is_msg_view<MSG>::value,
+                  "delta publish carries AMRPC_DEFINE structs");
+    return detail::PullDelta(host, method, [func{std::move(func)}](folly::Try<std::string>&& raw_try) {
+        func(folly::makeTryWith([&raw_try]() {
+            return detail::UnpackMsg<MSG>(std::move(raw_try).value());
+        }));
+    });
+}
+
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullPrefix(std::string_view host, std::string_view prefix,
+           std::function<void(std::string_view method, folly::Try<MSG>&&)>&& func) {
+    return detail::Puller::Create(detail::MessageType::MSGPACK, host, detail::PrefixMethod(prefix),
+                                  [func{std::move(func)}](folly::Try<std::string>&& raw_try) {
+                                      std::string method;
+                                      auto t = folly::makeTryWith([&]() {
+                                          auto oh = detail::UnpackHandle(std::move(raw_try).value());
+                                          auto[m, payload] = oh->get().as<std::tuple<std::string, Bytes>>();
+                                          method = std::move(m);
+                                          return detail::DecodePublish<MSG>(std::move(payload));
+                                      });
+                                      func(method, std::move(t));
                                   });
 }
 
+#if FOLLY_HAS_COROUTINES
+//Pull as an async generator: for co_await (auto&& msg : PullStream<MSG>(host, method)).
+//The subscription lives as long as the generator, a closed stream is thrown from the next read.
+template<typename MSG>
+folly::coro::AsyncGenerator<MSG&&> PullStream(std::string host, std::string method) {
+    auto queue = std::make_shared<folly::coro::UnboundedQueue<folly::Try<MSG>>>();
+    auto puller = co_await Pull<MSG>(host, method, [queue](folly::Try<MSG>&& t) {
+        queue->enqueue(std::move(t));
+    });
+    while (true) {
+        auto t = co_await queue->dequeue();
+        co_yield std::move(t).value();
+    }
+}
+#endif
+
 /////////////////////////////////////////////////////////
 // AddRpc
 /////////////////////////////////////////////////////////
 template<typename Description, typename Callback>
-void Server::AddRpc(std::string_view m, Callback&& cb) {
+void Server::AddRpc(std::string_view m, Callback&& cb, unsigned int flags) {
     using namespace std;
     using Type = detail::MessageType;
     using Trait = detail::DescriptionTrait<Description>;
     using Args = typename Trait::Args;
     using Ret = typename Trait::Ret;
-    static_assert(Trait::template is_legal_callback<Callback>::value, "Check your callback args and return");
-    typename Trait::Func func(forward<Callback>(cb));
+    using IsTask = detail::is_task_callback<Description, Callback>;
+    static_assert(Trait::template is_legal_callback<Callback>::value || IsTask::value,
+                  "Check your callback args and return");
+    typename Trait::Func func = [&]() -> typename Trait::Func {
+        if constexpr (IsTask::value) return detail::TaskAdapter<Description>::Wrap(forward<Callback>(cb));
+        else return typename Trait::Func(forward<Callback>(cb));
+    }();
+
+    auto executor = &detail::GetRpcExecutor(flags);
+
+    //typed is the handler for inproc:// callers with the same description, skipping the codec
+    auto add = [&](Type type, detail::RawRpc&& raw_rpc, shared_ptr<const void> typed = nullptr) {
+        if (flags & RPC_COALESCE) raw_rpc = detail::Coalesce(move(raw_rpc));
+        auto rpc = make_shared<const detail::RawRpc>(move(raw_rpc));
+        detail::RawRpc handler = [recorder = recorder_, method = string(m), type, rpc, executor](string&& raw) {
+            if (recorder->Active()) recorder->Record(detail::CAPTURE_RPC, type, method, raw);
+            auto size = raw.size();
+            if (!detail::AcquireBudget(size)) {
+                return folly::makeSemiFuture<string>(Exception("rpc rejected: over memory budget"));
+            }
+            //released when the handler completes, also when the reply is dropped or the task never runs
+            auto budget = make_shared<detail::BudgetGuard>(size);
+            //the handler and the packing of its reply run in one task in the lane of the rpc,
+            //the budget is released by a deferred step without another hop
+            return folly::via(executor, [rpc, raw{move(raw)}, budget]() mutable {
+                return (*rpc)(move(raw));
+            }).semi().defer([budget](folly::Try<string>&& t) {
+                return move(t).value();
+            });
+        };
+        inproc_->AddRpc(m, {type, typeid(Description), move(typed), make_shared<const detail::RawRpc>(handler)});
+        AddRawRpc(type, m, Trait::GetMethodName(m), move(handler));
+    };
 
     if constexpr (is_same_v<string, Ret> && (is_same_v<tuple<string_view>, Args> || is_same_v<tuple<string>, Args>)) {
         //string(string)
-        AddRawRpc(Type::TEXT, m, Trait::GetMethodName(m), move(func));
+        add(Type::TEXT, move(func));
     } else if constexpr (is_same_v<folly::dynamic, Ret> && is_same_v<tuple<folly::dynamic>, Args>) {
         //dynamic(dynamic)
-        AddRawRpc(Type::TEXT, m, Trait::GetMethodName(m), [func{move(func)}](string&& raw) {
+        add(Type::TEXT, [func{move(func)}](string&& raw) {
             return func(folly::parseJson(raw)).deferValue([](folly::dynamic&& res) -> string {
                 return folly::toJson(res);
-            }).via(&detail::GetAmrpcExecutor()).semi();
+            });
         });
     } else if constexpr (is_same_v<Bytes, Ret> &&
                          (is_same_v<tuple<Bytes>, Args> || is_same_v<tuple<BytesView>, Args>)) {
         //Bytes(Bytes)
-        AddRawRpc(Type::BIN, m, Trait::GetMethodName(m), [func{move(func)}](string&& raw) {
+        add(Type::BIN, [func{move(func)}](string&& raw) {
             return func(Bytes(move(raw))).deferValue([](Bytes&& bytes) -> string {
                 return move(bytes);
-            }).via(&detail::GetAmrpcExecutor()).semi();
+            });
         });
     } else {
         //msgpack(msgpack)
-        AddRawRpc(Type::MSGPACK, m, Trait::GetMethodName(m), [this, func{move(func)}](string&& raw) mutable {
-            return folly::makeSemiFutureWith([raw{move(raw)}, &func]() {
-                msgpack::object_handle oh;
+        auto typed = detail::InprocTyped<Description>::Wrap(func, executor);
+        add(Type::MSGPACK, [func{move(func)}](string&& raw) mutable {
+            return folly::makeSemiFutureWith([raw{move(raw)}, &func]() mutable {
+                //kept until the handler completes, views inside the args stay valid across co_await
+                auto request = make_shared<pair<string, msgpack::object_handle>>(move(raw), msgpack::object_handle());
                 optional<typename Trait::Args> args;
                 try {
-                    msgpack::unpack(oh, raw.data(), raw.size());
-                    args = oh.get().as<typename Trait::Args>();
+                    msgpack::unpack(request->second, request->first.data(), request->first.size());
+                    args = request->second.get().as<typename Trait::Args>();
                 } catch (exception& e) {
                     throw Exception(string("bad rpc request: ") + e.what());
                 }
-                return apply(func, move(args).value());
+                return apply(func, move(args).value()).defer([request](folly::Try<typename Trait::Ret>&& t) {
+                    return move(t).value();
+                });
             }).deferValue([](const typename Trait::Ret& ret) {
-                    msgpack::sbuffer buffer;
-                    msgpack::pack(buffer, ret);
-                    auto size = buffer.size();
-                    return string(buffer.release(), size);
-                })
-                .via(&detail::GetAmrpcExecutor()).semi();
+                return detail::PackToString(ret);
+            });
+        }, move(typed));
+    }
+}
+
+/////////////////////////////////////////////////////////
+// AddBatchRpc
+/////////////////////////////////////////////////////////
+namespace detail {
+template<typename R, typename... Args>
+class Batcher : public std::enable_shared_from_this<Batcher<R, Args...>> {
+public:
+    using Batch = std::vector<std::tuple<Args...>>;
+    using Handler = std::function<folly::SemiFuture<std::vector<R>>(Batch&&)>;
+
+    //executor is the lane of the rpc, batches flushed by the timer run there too
+    Batcher(Handler&& handler, const BatchOptions& options, folly::Executor* executor)
+        : handler_(std::move(handler)), options_(options), executor_(executor) {
+        requests_.reserve(options_.max_size);
+        promises_.reserve(options_.max_size);
+    }
+
+    //The callback of AddRpc
+    std::function<folly::SemiFuture<R>(Args...)> Callback() {
+        return [self = this->shared_from_this()](Args... args) {
+            return self->Add(std::make_tuple(std::move(args)...));
+        };
+    }
+
+private:
+    folly::SemiFuture<R> Add(std::tuple<Args...>&& args) {
+        folly::Promise<R> promise;
+        auto res = promise.getSemiFuture();
+        size_t size;
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.push_back(std::move(args));
+            promises_.push_back(std::move(promise));
+            size = requests_.size();
+            generation = generation_;
+        }
+        if (size >= options_.max_size) {
+            Flush(generation);
+        } else if (size == 1) {
+            folly::futures::sleep(options_.max_wait).via(executor_).thenValue(
+                [weak = this->weak_from_this(), generation](folly::Unit) {
+                    if (auto self = weak.lock()) self->Flush(generation);
+                });
+        }
+        return res;
+    }
+
+    //generation tells whether the timer's batch has already been flushed by size
+    void Flush(uint64_t generation) {
+        Batch batch;
+        std::vector<folly::Promise<R>> promises;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation != generation_ || requests_.empty()) return;
+            ++generation_;
+            batch.swap(requests_);
+            promises.swap(promises_);
+            requests_.reserve(options_.max_size);
+            promises_.reserve(options_.max_size);
+        }
+        folly::makeSemiFutureWith([&]() {
+            return handler_(std::move(batch));
+        }).via(executor_).thenTry([promises{std::move(promises)}](folly::Try<std::vector<R>>&& t) mutable {
+            if (t.hasValue() && t.value().size() != promises.size()) {
+                t = folly::Try<std::vector<R>>(folly::make_exception_wrapper<Exception>(
+                    "batch rpc: " + std::to_string(t.value().size()) + " results for " +
+                    std::to_string(promises.size()) + " requests"));
+            }
+            for (size_t i = 0; i < promises.size(); ++i) {
+                if (t.hasException()) {
+                    promises[i].setException(t.exception());
+                } else {
+                    promises[i].setValue(std::move(t.value()[i]));
+                }
+            }
         });
     }
+
+    Handler handler_;
+    BatchOptions options_;
+    folly::Executor* executor_;
+    std::mutex mutex_;
+    Batch requests_;
+    std::vector<folly::Promise<R>> promises_;
+    uint64_t generation_ = 0;
+};
+
+template<typename R, typename... Args>
+struct BatcherOf<R(Args...)> {
+    using type = Batcher<R, std::decay_t<Args>...>;
+};
+}//detail
+
+template<typename Description, typename Callback>
+void Server::AddBatchRpc(std::string_view m, Callback&& cb, const BatchOptions& options, unsigned int flags) {
+    using Batcher = typename detail::BatcherOf<Description>::type;
+    using Batch = typename Batcher::Batch;
+    static_assert(std::is_invocable_v<Callback, Batch&&>, "Check your batch callback args");
+    auto batcher = std::make_shared<Batcher>([cb{std::forward<Callback>(cb)}](Batch&& batch) mutable {
+        return folly::makeSemiFutureWith([&]() {
+            return cb(std::move(batch));
+        });
+    }, options, &detail::GetRpcExecutor(flags));
+    AddRpc<Description>(m, batcher->Callback(), flags);
 }
 
 /////////////////////////////////////////////////////////
@@ -286,76 +1252,196 @@ void Server::AddRpc(std::string_view m, Callback&& cb) {
 template<typename Msg>
 inline void Server::AddPublish(std::string_view method, unsigned int queue_size) {
     using Trait = detail::DescriptionTrait<Msg(void)>;
-    AddRawPublish(detail::MessageType::MSGPACK, method, Trait::GetMethodName(method), queue_size);
+    AddChannel(detail::MessageType::MSGPACK, method, Trait::GetMethodName(method), queue_size);
 }
 
 template<>
 inline void Server::AddPublish<std::string>(std::string_view method, unsigned int queue_size) {
     using Trait = detail::DescriptionTrait<std::string(void)>;
-    AddRawPublish(detail::MessageType::TEXT, method, Trait::GetMethodName(method), queue_size);
+    AddChannel(detail::MessageType::TEXT, method, Trait::GetMethodName(method), queue_size);
 }
 
 template<>
 inline void Server::AddPublish<folly::dynamic>(std::string_view method, unsigned int queue_size) {
     using Trait = detail::DescriptionTrait<std::string(void)>;
-    AddRawPublish(detail::MessageType::TEXT, method, Trait::GetMethodName(method), queue_size);
+    AddChannel(detail::MessageType::TEXT, method, Trait::GetMethodName(method), queue_size);
 }
 
 template<>
 inline void Server::AddPublish<Bytes>(std::string_view method, unsigned int queue_size) {
     using Trait = detail::DescriptionTrait<Bytes(void)>;
-    AddRawPublish(detail::MessageType::BIN, method, Trait::GetMethodName(method), queue_size);
+    AddChannel(detail::MessageType::BIN, method, Trait::GetMethodName(method), queue_size);
+}
+
+template<typename Msg>
+void Server::AddPublish(std::string_view method, const HistoryOptions& history, unsigned int queue_size) {
+    AddPublish<Msg>(method, queue_size);
+    auto log = std::make_shared<detail::HistoryLog>(method, history);
+    AddRawPublish(detail::MessageType::MSGPACK, log->SeqMethod(),
+                  detail::DescriptionTrait<Msg(void)>::GetMethodName(log->SeqMethod()), queue_size);
+    AddRpc<detail::HistoryBatch(uint64_t)>(detail::HistoryMethod(method), [log](uint64_t from) {
+        return log->Read(from);
+    });
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    routes_->histories.insert_or_assign(std::string(method), std::move(log));
+}
+
+template<typename Msg>
+void Server::AddPublish(std::string_view method, const DeltaOptions& delta, unsigned int queue_size) {
+    static_assert(detail::is_amrpc_msg<Msg>::value, "delta publish needs an AMRPC_DEFINE struct");
+    AddPublish<Msg>(method, queue_size);
+    auto encoder = std::make_shared<detail::DeltaEncoder>(delta);
+    AddRpc<detail::Keyframe(void)>(detail::KeyframeMethod(method), [encoder]() {
+        return encoder->Snapshot();
+    });
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    routes_->deltas.insert_or_assign(std::string(method), std::move(encoder));
+}
+
+//Also publish on the served prefix channels of its parent paths: /a/b/c goes to "/*", "/a/*" and "/a/b/*"
+inline void Server::AddChannel(detail::MessageType type, std::string_view method, std::string_view func_name,
+                               unsigned int queue_size) {
+    AddRawPublish(type, method, func_name, queue_size);
+    inproc_->AddPublish(method);
+    if (method.rfind("/amrpc/", 0) == 0) return;
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    auto& channels = routes_->prefixes[std::string(method)];
+    channels.clear();
+    for (auto& channel : routes_->prefix_channels) {
+        if (detail::UnderPrefix(method, channel)) channels.push_back(channel);
+    }
+}
+
+inline void Server::ServePrefix(std::string_view prefix, unsigned int queue_size) {
+    auto channel = detail::PrefixMethod(prefix);
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    if (!routes_->prefix_channels.insert(channel).second) return;
+    using Trait = detail::DescriptionTrait<std::tuple<std::string, Bytes>(void)>;
+    AddRawPublish(detail::MessageType::MSGPACK, channel, Trait::GetMethodName(channel), queue_size);
+    for (auto&[method, channels] : routes_->prefixes) {
+        if (detail::UnderPrefix(method, channel)) channels.push_back(channel);
+    }
+}
+
+inline void Server::Del(std::string_view method) {
+    RawServer::Del(method);
+    inproc_->Del(method);
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    routes_->limits.erase(std::string(method));
+    if (auto it = routes_->histories.find(method); it != routes_->histories.end()) {
+        RawServer::Del(it->second->SeqMethod());
+        RawServer::Del(detail::HistoryMethod(method));
+        inproc_->Del(detail::HistoryMethod(method));
+        routes_->histories.erase(it);
+    }
+    if (auto it = routes_->deltas.find(method); it != routes_->deltas.end()) {
+        RawServer::Del(detail::KeyframeMethod(method));
+        inproc_->Del(detail::KeyframeMethod(method));
+        routes_->deltas.erase(it);
+    }
+    if (auto it = routes_->prefixes.find(method); it != routes_->prefixes.end()) routes_->prefixes.erase(it);
 }
 
 /////////////////////////////////////////////////////////
 // Publish
 /////////////////////////////////////////////////////////
+inline void Server::SetPublishLimit(std::string_view method, const PublishLimit& limit) {
+    std::unique_lock<std::shared_mutex> lock(routes_->mutex);
+    routes_->limits.insert_or_assign(std::string(method), limit);
+}
+
+inline void Server::StartCapture(std::string_view path, const CaptureOptions& options) {
+    recorder_->Start(path, options);
+}
+
+inline void Server::StopCapture() {
+    recorder_->Stop();
+}
+
+inline void Server::ServeInproc(std::string_view uri) {
+    inproc_->Listen(uri);
+}
+
+inline void Server::Deliver(detail::MessageType type, std::string_view method, std::string&& data,
+                            std::type_index msg_type, const void* msg) {
+    {
+        std::shared_lock<std::shared_mutex> lock(routes_->mutex);
+        if (auto it = routes_->limits.find(method); it != routes_->limits.end()) {
+            auto& limit = it->second;
+            if (limit.max_message_bytes && data.size() > limit.max_message_bytes) {
+                if (limit.policy == BUDGET_REJECT) throw Exception("publish rejected: over message bytes limit");
+                detail::CountDroppedPublish();
+                return;
+            }
+        }
+        inproc_->Publish(method, data, msg_type, msg);
+        if (recorder_->Active()) recorder_->Record(detail::CAPTURE_PUBLISH, type, method, data);
+        if (auto it = routes_->histories.find(method); it != routes_->histories.end()) {
+            auto& log = *it->second;
+            log.Append(data, [&](uint64_t seq) {
+                if (!GetPullerSize(log.SeqMethod())) return;
+                RawPublish(detail::MessageType::MSGPACK, log.SeqMethod(),
+                           detail::PackToString(std::make_tuple(seq, BytesView(data))));
+            });
+        }
+        if (auto it = routes_->prefixes.find(method); it != routes_->prefixes.end()) {
+            //packed once, only when a prefix channel has pullers
+            std::string envelope;
+            for (auto& channel : it->second) {
+                if (!GetPullerSize(channel)) continue;
+                if (envelope.empty()) envelope = detail::PackToString(std::make_tuple(method, BytesView(data)));
+                RawPublish(detail::MessageType::MSGPACK, channel, std::string(envelope));
+            }
+        }
+        if (auto it = routes_->deltas.find(method); it != routes_->deltas.end()) {
+            //published under the encoder lock, frames go out in seq order
+            it->second->Encode(std::move(data), [&](std::string&& frame) {
+                RawPublish(type, method, std::move(frame));
+            });
+            return;
+        }
+    }
+    RawPublish(type, method, std::move(data));
+}
+
 template<typename Msg>
 void Server::Publish(std::string_view method, const Msg& msg) {
-    msgpack::sbuffer buffer;
-    msgpack::pack(buffer, msg);
-    auto size = buffer.size();
-    std::string data(buffer.release(), size);
-    RawPublish(detail::MessageType::MSGPACK, method, std::move(data));
+    Deliver(detail::MessageType::MSGPACK, method, detail::PackToString(msg), typeid(Msg), &msg);
 }
 
 template<>
 inline void Server::Publish<folly::dynamic>(std::string_view method, const folly::dynamic& msg) {
-    RawPublish(detail::MessageType::TEXT, method, folly::toJson(msg));
+    Deliver(detail::MessageType::TEXT, method, folly::toJson(msg));
 }
 
 template<>
 inline void Server::Publish<std::string>(std::string_view method, const std::string& msg) {
-    RawPublish(detail::MessageType::TEXT, method, std::string(msg));
+    Deliver(detail::MessageType::TEXT, method, std::string(msg));
 }
 
 template<>
 inline void Server::Publish<Bytes>(std::string_view method, const Bytes& msg) {
-    RawPublish(detail::MessageType::BIN, method, std::string(msg));
+    Deliver(detail::MessageType::BIN, method, std::string(msg));
 }
 
 template<typename Msg>
 void Server::Publish(std::string_view method, Msg&& msg) {
-    msgpack::sbuffer buffer;
-    msgpack::pack(buffer, msg);
-    auto size = buffer.size();
-    std::string data(buffer.release(), size);
-    RawPublish(detail::MessageType::MSGPACK, method, std::move(data));
+    Deliver(detail::MessageType::MSGPACK, method, detail::PackToString(msg), typeid(std::decay_t<Msg>), &msg);
 }
 
 template<>
 inline void Server::Publish<folly::dynamic>(std::string_view method, folly::dynamic&& msg) {
-    RawPublish(detail::MessageType::TEXT, method, folly::toJson(msg));
+    Deliver(detail::MessageType::TEXT, method, folly::toJson(msg));
 }
 
 template<>
 inline void Server::Publish<std::string>(std::string_view method, std::string&& msg) {
-    RawPublish(detail::MessageType::TEXT, method, std::move(msg));
+    Deliver(detail::MessageType::TEXT, method, std::move(msg));
 }
 
 template<>
 inline void Server::Publish<Bytes>(std::string_view method, Bytes&& msg) {
-    RawPublish(detail::MessageType::BIN, method, std::move(msg));
+    Deliver(detail::MessageType::BIN, method, std::move(msg));
 }
 }//amrpc
 
@@ -369,6 +1455,14 @@ namespace adaptor {
 template<>
 struct convert<amrpc::Bytes> {
     msgpack::object const& operator()(msgpack::object const& o, amrpc::Bytes& v) const {
+        if (o.type == msgpack::type::STR && amrpc::detail::JsonBytesScope::Active()) {
+            //Bytes of a json request arrive as base64 strings
+            v.clear();
+            if (!amrpc::detail::Base64Decode(std::string_view(o.via.str.ptr, o.via.str.size), v)) {
+                throw msgpack::type_error();
+            }
+            return o;
+        }
         if (o.type != msgpack::type::BIN) throw msgpack::type_error();
         v = amrpc::Bytes(std::string_view(o.via.str.ptr, o.via.str.size));
         return o;
@@ -408,7 +1502,7 @@ struct pack<amrpc::BytesView> {
     template<typename Stream>
     packer<Stream>& operator()(msgpack::packer<Stream>& o, amrpc::BytesView const& v) const {
         o.pack_bin(v.size());
-        o.pack_bin_body(v.data());
+        o.pack_bin_body(v.data(), v.size());
         return o;
     }
 };
@@ -1,9 +1,17 @@
 #ifndef AMRPC_AMRPC_H
 #define AMRPC_AMRPC_H
 
+#include <atomic>
+#include <string>
 #include <string_view>
 #include <functional>
 #include <memory>
+#include <chrono>
+#include <map>
+#include <set>
+#include <shared_mutex>
+#include <typeindex>
+#include <vector>
 
 #include <ecv/ecvdef.h>
 #include <ecv/utils.hpp>
@@ -18,6 +26,12 @@ class SemiFuture;
 
 template<class T>
 class Try;
+
+namespace coro {
+template<typename T>
+class Task;
+}//coro
+
 }//folly
 
 namespace amrpc {
@@ -33,6 +47,159 @@ struct Exception : public std::exception {
     std::string detail;
 };
 
+//Client side cache of rpc responses, keyed by the packed arguments
+struct CacheOptions {
+    //responses younger than ttl are returned directly
+    std::chrono::milliseconds ttl{1000};
+    //after ttl, stale responses are still returned for this long while a refresh runs in background
+    std::chrono::milliseconds stale{0};
+    //max cached responses, least recently used ones are evicted first
+    std::size_t capacity = 1024;
+};
+
+//Retained history of a publish, see PullFrom
+struct HistoryOptions {
+    //keep at most this many messages, 0 for no limit
+    std::size_t max_messages = 0;
+    //drop messages older than this, 0 for no limit
+    std::chrono::milliseconds max_age{0};
+    //the log is kept in memory mapped segment files created here, they are unlinked right away
+    std::string dir = "/tmp";
+    std::size_t segment_size = 64 << 20;
+    //max payload bytes sent in one catch-up batch
+    std::size_t batch_size = 1 << 20;
+};
+
+//Publish of the changed fields of an AMRPC_DEFINE struct only, see PullDelta
+struct DeltaOptions {
+    //every keyframe_interval messages all the fields are sent, 1 sends every message in full
+    unsigned int keyframe_interval = 100;
+};
+
+//Traffic capture of a Server, see Server::StartCapture
+struct CaptureOptions {
+    //records are collected in buffers of this size, written to the file by a background thread
+    std::size_t buffer_size = 4 << 20;
+    //records arriving while every buffer waits for the disk are dropped
+    unsigned int buffers = 4;
+};
+
+//Where RemoteFunction decodes its replies
+struct CompletionOptions {
+    //replies up to this size are decoded inline on the receiving thread, saving the executor hop
+    std::size_t inline_threshold = 0;
+    //larger replies are decoded here, nullptr for the amrpc executor
+    folly::Executor* executor = nullptr;
+};
+
+//Health tracking of BalancedRemoteFunction
+struct BalanceOptions {
+    //consecutive transport failures before a host is ejected
+    unsigned int max_failures = 3;
+    //ejected hosts are probed with Enabled() after this interval, doubled on each failed probe
+    std::chrono::milliseconds eject_interval{1000};
+    std::chrono::milliseconds max_eject_interval{30000};
+    //a recovered host takes this long to get back its full share of traffic
+    std::chrono::milliseconds warmup{10000};
+    //only for idempotent rpc: a call slower than hedge_percentile of the recent latencies
+    //is sent again to another host, the first reply wins and the other one is ignored
+    bool hedge = false;
+    double hedge_percentile = 0.95;
+    //hedged calls are capped at this ratio of all calls
+    double hedge_budget = 0.05;
+    //no hedging before this many latency samples
+    unsigned int hedge_min_samples = 100;
+};
+
+enum RpcFlag : unsigned int {
+    RPC_DEFAULT = 0,
+    //identical in-flight requests share one handler call, only for idempotent rpc
+    RPC_COALESCE = 1u << 0,
+    //run the handler in the control lane (health checks, orchestration)
+    RPC_CONTROL = 1u << 1,
+    //run the handler in the bulk lane
+    RPC_BULK = 1u << 2,
+};
+
+//Batching of AddBatchRpc, a batch is handled when it is full or its first request has waited max_wait
+struct BatchOptions {
+    std::size_t max_size = 64;
+    std::chrono::microseconds max_wait{1000};
+};
+
+//Lanes of the amrpc executor, served in strict priority order
+enum Priority {
+    PRIORITY_CONTROL = 0,
+    PRIORITY_NORMAL,
+    PRIORITY_BULK
+};
+
+struct LaneStats {
+    std::size_t executed = 0;
+    std::size_t pending = 0;
+    //time spent in the lane queue
+    std::chrono::microseconds total_wait{0};
+    std::chrono::microseconds max_wait{0};
+};
+
+LaneStats GetLaneStats(Priority);
+
+//A lane whose oldest task has waited this long is served before the higher ones
+void SetLaneMaxWait(std::chrono::milliseconds);
+
+//What to do with a publish over its limit
+enum BudgetPolicy {
+    BUDGET_DROP = 0,
+    //Publish throws amrpc::Exception
+    BUDGET_REJECT
+};
+
+//Byte limit of one publish method. Subscriber queues hold queue_size messages,
+//so a subscriber never holds more than queue_size * max_message_bytes of it.
+struct PublishLimit {
+    //0 for no limit
+    std::size_t max_message_bytes = 0;
+    BudgetPolicy policy = BUDGET_DROP;
+};
+
+struct MemoryUsage {
+    //requests of the process whose handler has not completed
+    std::size_t rpc_bytes = 0;
+    std::size_t rejected_rpcs = 0;
+    std::size_t dropped_publishes = 0;
+};
+
+//Process-wide limit of in-flight rpc request bytes, requests above it are rejected. 0 for no limit.
+void SetMemoryBudget(std::size_t rpc_bytes);
+
+MemoryUsage GetMemoryUsage();
+
+//Where the threads of the library run, see SetThreadPlacement
+struct PlacementOptions {
+    //cpus of the amrpc executor thread (amrpc_evb), empty to leave it to the scheduler
+    std::vector<int> amrpc_cpus;
+    //cpus of the background threads (capture writer)
+    std::vector<int> background_cpus;
+    //a thread pinned to the cpus of a single numa node prefers memory of that node
+    bool numa_local = true;
+};
+
+struct ThreadPlacement {
+    std::string name;
+    int tid = 0;
+    //cpus the thread may run on
+    std::vector<int> cpus;
+    //where the thread was running when it was placed, -1 if unknown
+    int cpu = -1;
+    int node = -1;
+};
+
+//Pin the threads of the library. Call at init, never from an amrpc callback.
+//Background threads started later are placed when they start.
+void SetThreadPlacement(const PlacementOptions&);
+
+std::vector<ThreadPlacement> GetThreadPlacement();
+
 namespace detail {
 
 enum MessageType {
@@ -41,22 +208,123 @@ enum MessageType {
     MSGPACK
 };
 
+using RawRpc = std::function<folly::SemiFuture<std::string>(std::string&&)>;
+
 folly::Executor& GetAmrpcExecutor();
 
+enum ThreadRole {
+    THREAD_AMRPC = 0,
+    THREAD_BACKGROUND
+};
+
+//Pin the calling thread as configured for its role and record it for GetThreadPlacement
+void PlaceThread(ThreadRole, std::string_view name);
+
+//Runs on the amrpc executor, after every pending task of the higher priority lanes
+folly::Executor& GetLaneExecutor(Priority);
+
+//Wrap a raw rpc, requests with the same packed bytes are served by the first in-flight call
+RawRpc Coalesce(RawRpc&&);
+
+template<typename R>
+class ResponseCache;
+
+template<typename Description>
+struct BatcherOf;
+
+//Base64 with padding, appended to out. Vectorized when the cpu has AVX2 or SSSE3.
+std::size_t Base64EncodedSize(std::size_t size);
+
+void Base64Encode(std::string_view in, std::string& out);
+
+//padding is optional, out is unchanged when in is not base64
+bool Base64Decode(std::string_view in, std::string& out);
+
+//Codec tiers, the functions above use the widest one the cpu runs
+enum Base64Tier {
+    BASE64_SCALAR,
+    BASE64_SSSE3,
+    BASE64_AVX2,
+};
+
+//tiers the cpu runs, scalar first. The overloads below take only these.
+std::vector<Base64Tier> Base64Tiers();
+
+void Base64Encode(std::string_view in, std::string& out, Base64Tier tier);
+
+bool Base64Decode(std::string_view in, std::string& out, Base64Tier tier);
+
+//While one is alive on the thread, a msgpack STR converts to Bytes by base64 decoding.
+//Only for messages converted from json, plain msgpack keeps requiring BIN.
+class JsonBytesScope : ecv::MoveOnly {
+public:
+    JsonBytesScope() noexcept;
+
+    ~JsonBytesScope();
+
+    static bool Active() noexcept;
+
+private:
+    bool previous_;
+};
+
+//util::Json2Msgpack, Bytes are left as base64 strings
+std::string JsonToMsgpack(std::string_view json);
+
+//Account an inbound request against the memory budget, false if it does not fit
+bool AcquireBudget(std::size_t bytes);
+
+void ReleaseBudget(std::size_t bytes);
+
+//Releases an acquired budget when destroyed
+class BudgetGuard : ecv::MoveOnly {
+public:
+    explicit BudgetGuard(std::size_t bytes) noexcept : bytes_(bytes) {}
+
+    ~BudgetGuard() { ReleaseBudget(bytes_); }
+
+private:
+    std::size_t bytes_;
+};
+
+void CountDroppedPublish();
+
 class RawRemoteFunction : ecv::MoveOnly {
 public:
     RawRemoteFunction(std::string_view host, std::string_view method);
 
     virtual ~RawRemoteFunction() = default;
 
+    //inproc:// hosts are served by a same-process server, the others over the net
     folly::SemiFuture<folly::Unit> Enabled();
 
 protected:
     [[nodiscard]] folly::SemiFuture<std::string> RawCall(MessageType, std::string_view data) const;
 
-private:
     std::string_view host_;
     std::string_view method_;
+
+private:
+    folly::SemiFuture<folly::Unit> NetEnabled();
+
+    [[nodiscard]] folly::SemiFuture<std::string> NetCall(MessageType, std::string_view data) const;
+};
+
+//Picks a host per call by power of two choices on outstanding calls and ewma latency.
+class Balancer : ecv::MoveOnly {
+public:
+    Balancer(std::vector<std::string> hosts, std::string_view method, const BalanceOptions& options);
+
+    //Succeeds when any host is enabled
+    folly::SemiFuture<folly::Unit> Enabled();
+
+    //Send a request to a picked host, hedged to a second one if enabled
+    folly::SemiFuture<std::string> Call(MessageType, std::string&& data) const;
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
 };
 
 class Puller : ecv::MoveOnly {
@@ -80,6 +348,178 @@ private:
     std::shared_ptr<Impl> pimpl_;
 };
 
+struct HistoryBatch;
+
+struct Keyframe;
+
+template<typename MSG>
+class SharedStream;
+
+//Reserved methods of a publish added with HistoryOptions:
+//rpc HistoryMethod(method) returns the retained messages from a seq,
+//publish SeqMethod(method) carries the live messages with their seq.
+std::string HistoryMethod(std::string_view method);
+
+std::string SeqMethod(std::string_view method);
+
+//Memory mapped segmented log of the messages of one publish
+class HistoryLog : ecv::MoveOnly {
+public:
+    HistoryLog(std::string_view method, const HistoryOptions& options);
+
+    //publish is called with the seq of the message before the next one is appended
+    void Append(std::string_view data, const std::function<void(uint64_t)>& publish);
+
+    [[nodiscard]] HistoryBatch Read(uint64_t from) const;
+
+    [[nodiscard]] std::string_view SeqMethod() const;
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
+};
+
+//Reserved rpc of a publish added with DeltaOptions, returns the last message in full
+std::string KeyframeMethod(std::string_view method);
+
+//Turns the packed messages of one publish into frames of the fields changed since the previous message
+class DeltaEncoder : ecv::MoveOnly {
+public:
+    explicit DeltaEncoder(const DeltaOptions& options);
+
+    //publish is called with the frame before the next message is encoded
+    void Encode(std::string&& packed, const std::function<void(std::string&&)>& publish);
+
+    [[nodiscard]] Keyframe Snapshot() const;
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
+};
+
+enum CaptureKind {
+    CAPTURE_RPC = 0,
+    CAPTURE_PUBLISH
+};
+
+//Writes inbound rpc requests and outbound publishes to a capture file
+class Recorder : ecv::MoveOnly {
+public:
+    Recorder();
+
+    void Start(std::string_view path, const CaptureOptions& options);
+
+    //flush the buffered records and close the file
+    void Stop();
+
+    [[nodiscard]] bool Active() const;
+
+    [[nodiscard]] std::size_t Dropped() const;
+
+    void Record(CaptureKind, MessageType, std::string_view method, std::string_view payload);
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
+};
+
+struct CaptureRecord {
+    CaptureKind kind = CAPTURE_RPC;
+    MessageType type = BIN;
+    //since the capture started
+    std::chrono::nanoseconds time{0};
+    std::string method;
+    std::string payload;
+};
+
+class CaptureReader : ecv::MoveOnly {
+public:
+    explicit CaptureReader(std::string_view path);
+
+    //false at the end of the file
+    bool Next(CaptureRecord& record);
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
+};
+
+//Extra channels of the publishes of a Server, methods may be added while publishing
+struct PublishRoutes {
+    std::shared_mutex mutex;
+    std::map<std::string, std::shared_ptr<HistoryLog>, std::less<>> histories;
+    //method -> the served prefix channels it is also published on
+    std::map<std::string, std::vector<std::string>, std::less<>> prefixes;
+    //prefix channels added with ServePrefix
+    std::set<std::string, std::less<>> prefix_channels;
+    std::map<std::string, PublishLimit, std::less<>> limits;
+    std::map<std::string, std::shared_ptr<DeltaEncoder>, std::less<>> deltas;
+};
+
+folly::SemiFuture<Puller> PullHistory(std::string_view host, std::string_view method, uint64_t from,
+                                      std::function<void(folly::Try<std::string>&&, uint64_t)>&&);
+
+//func gets every message in full, packed
+folly::SemiFuture<Puller> PullDelta(std::string_view host, std::string_view method,
+                                    std::function<void(folly::Try<std::string>&&)>&&);
+
+//A rpc of a Server as seen by inproc:// clients
+struct InprocRpc {
+    MessageType type = BIN;
+    //typed is a std::function<folly::SemiFuture<R>(Args...)> for the description R(Args...), may be null
+    std::type_index description = typeid(void);
+    std::shared_ptr<const void> typed;
+    std::shared_ptr<const RawRpc> raw;
+};
+
+//A subscriber of a publish of a Server, called on the publishing thread
+struct InprocSubscriber {
+    //messages published as this type are handed over as a const pointer to it
+    std::type_index type = typeid(void);
+    std::function<void(const void*)> typed;
+    //any other message arrives packed, an exception when the publish is closed
+    std::function<void(folly::Try<std::string>&&)> raw;
+};
+
+//The rpc and publishes of a Server for clients in the same process, see Server::ServeInproc
+class InprocEndpoint : public std::enable_shared_from_this<InprocEndpoint>, ecv::MoveOnly {
+public:
+    InprocEndpoint();
+
+    void Listen(std::string_view uri);
+
+    void AddRpc(std::string_view method, InprocRpc&& rpc);
+
+    void AddPublish(std::string_view method);
+
+    void Del(std::string_view method);
+
+    //msg is the published value when its type is known
+    void Publish(std::string_view method, const std::string& data, std::type_index type, const void* msg);
+
+    [[nodiscard]] folly::SemiFuture<std::string> Call(std::string_view method, MessageType, std::string&& data) const;
+
+    //the typed handler of method if it was added with the same description, null otherwise
+    [[nodiscard]] std::shared_ptr<const void> Typed(std::string_view method, std::type_index description) const;
+
+    //the subscription ends with the last copy of the returned token
+    [[nodiscard]] std::shared_ptr<void> Subscribe(std::string_view method, InprocSubscriber&& subscriber);
+
+private:
+    class Impl;
+
+    std::shared_ptr<Impl> pimpl_;
+};
+
+bool IsInproc(std::string_view host);
+
+//the server listening on host, throws if there is none
+std::shared_ptr<InprocEndpoint> FindInproc(std::string_view host);
+
 class RawServer : ecv::MoveOnly {
 public:
     explicit RawServer(std::string_view uri, bool enable_debug = true);
@@ -92,8 +532,7 @@ public:
 
 protected:
 
-    void AddRawRpc(MessageType, std::string_view method, std::string_view func_name,
-                   std::function<folly::SemiFuture<std::string>(std::string&&)>&&);
+    void AddRawRpc(MessageType, std::string_view method, std::string_view func_name, RawRpc&&);
 
     void AddRawPublish(MessageType, std::string_view method, std::string_view func_name, unsigned int queue_size);
 
@@ -143,6 +582,12 @@ class Bytes;
 
 class BytesView;
 
+//Lazy view of a received AMRPC_DEFINE message, fields are decoded on access.
+//Use it as the result of RemoteFunction or the message of Pull:
+//RemoteFunction<MsgView<Status>(int)>, Pull<MsgView<Status>>
+template<typename T>
+class MsgView;
+
 template<typename R, typename...Args>
 class RemoteFunction;
 
@@ -152,28 +597,169 @@ public:
     RemoteFunction(const std::string_view& host, const std::string_view& method) noexcept
         : RawRemoteFunction(host, method) {}
 
+    RemoteFunction(const std::string_view& host, const std::string_view& method,
+                   const CompletionOptions& completion) noexcept
+        : RawRemoteFunction(host, method), completion_(completion) {}
+
+    folly::SemiFuture<R> operator()(Args&& ... args) const;
+
+    //co_await func.CoCall(args...), only with coroutine support (FOLLY_HAS_COROUTINES).
+    //The reply is decoded on the awaiting coroutine's executor, the function must outlive the task.
+    folly::coro::Task<R> CoCall(Args... args) const;
+
+private:
+    CompletionOptions completion_;
+};
+
+template<typename R, typename...Args>
+class CachedRemoteFunction;
+
+//RemoteFunction with a response cache, only for rpc whose result depends on the arguments alone.
+template<typename R, typename...Args>
+class CachedRemoteFunction<R(Args...)> : public RemoteFunction<R(Args...)> {
+public:
+    CachedRemoteFunction(const std::string_view& host, const std::string_view& method,
+                         const CacheOptions& options = {});
+
+    folly::SemiFuture<R> operator()(Args&& ... args) const;
+
+    //drop all cached responses, in-flight calls are not affected
+    void Clear();
+
+private:
+    std::shared_ptr<detail::ResponseCache<R>> cache_;
+};
+
+template<typename R, typename...Args>
+class BalancedRemoteFunction;
+
+//RemoteFunction over a set of replicas (ipc:// and tcp:// may be mixed).
+//Hosts failing repeatedly are ejected, probed with Enabled() and brought back gradually.
+template<typename R, typename...Args>
+class BalancedRemoteFunction<R(Args...)> : ecv::MoveOnly {
+public:
+    BalancedRemoteFunction(std::vector<std::string> hosts, std::string_view method,
+                           const BalanceOptions& options = {});
+
+    folly::SemiFuture<folly::Unit> Enabled();
+
     folly::SemiFuture<R> operator()(Args&& ... args) const;
+
+private:
+    detail::Balancer balancer_;
 };
 
 template<typename MSG>
 folly::SemiFuture<detail::Puller>
 Pull(std::string_view host, std::string_view method, std::function<void(folly::Try<MSG>&&)>&&);
 
+//Handle of a PullShared subscription, the shared stream is closed with its last handle
+template<typename MSG>
+class SharedPuller : ecv::MoveOnly {
+public:
+    SharedPuller() noexcept = default;
+
+    SharedPuller(std::shared_ptr<detail::SharedStream<MSG>> stream, uint64_t id) noexcept;
+
+    SharedPuller(SharedPuller&& rhs) noexcept;
+
+    SharedPuller& operator=(SharedPuller&& rhs) noexcept;
+
+    ~SharedPuller();
+
+    [[nodiscard]] bool IsOpen() const;
+
+private:
+    std::shared_ptr<detail::SharedStream<MSG>> stream_;
+    uint64_t id_ = 0;
+};
+
+//Pull sharing one stream per (host, method, MSG) in the process, each message is decoded once
+//and handed to every callback. A callback may still run once while its handle is destroyed.
+template<typename MSG>
+folly::SemiFuture<SharedPuller<MSG>>
+PullShared(std::string_view host, std::string_view method, std::function<void(const folly::Try<MSG>&)>&&);
+
+//Pull every publish under a path prefix ("/market/*") over one stream, including methods added later.
+//The callback gets the method of each message, MSG should be the type of all of them (or Bytes).
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullPrefix(std::string_view host, std::string_view prefix,
+           std::function<void(std::string_view method, folly::Try<MSG>&&)>&&);
+
+//Pull of a publish added with HistoryOptions. The messages retained since seq `from` are delivered first,
+//then the live ones, without gaps or duplicates. Pass the last seq seen + 1 to resume after a restart.
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullFrom(std::string_view host, std::string_view method, uint64_t from,
+         std::function<void(folly::Try<MSG>&&, uint64_t seq)>&&);
+
+//Pull of a publish added with DeltaOptions. The last message is fetched on subscribe, the changed fields
+//are merged into it and every message is delivered in full. A missed frame fetches the last message again.
+template<typename MSG>
+folly::SemiFuture<detail::Puller>
+PullDelta(std::string_view host, std::string_view method, std::function<void(folly::Try<MSG>&&)>&&);
+
 class Server : public detail::RawServer {
 public:
     explicit Server(std::string_view uri) noexcept;
 
     template<typename Description, typename Callback>
-    void AddRpc(std::string_view m, Callback&&);
+    void AddRpc(std::string_view m, Callback&&, unsigned int flags = RPC_DEFAULT);
+
+    //Rpc whose concurrent requests are handled together. For Description R(Args...) the callback takes
+    //std::vector<std::tuple<Args...>>&& and returns std::vector<R> (or a future of it) in the same order.
+    //Clients call it with an ordinary RemoteFunction<R(Args...)>.
+    template<typename Description, typename Callback>
+    void AddBatchRpc(std::string_view m, Callback&&, const BatchOptions& options = {},
+                     unsigned int flags = RPC_DEFAULT);
 
     template<typename Msg>
     void AddPublish(std::string_view method, unsigned int queue_size = 10);
 
+    //Also keep the published messages for late subscribers, add before publishing
+    template<typename Msg>
+    void AddPublish(std::string_view method, const HistoryOptions& history, unsigned int queue_size = 10);
+
+    //Send only the fields changed since the previous message, Msg must be an AMRPC_DEFINE struct.
+    //Clients use PullDelta, a plain Pull can not decode the frames.
+    template<typename Msg>
+    void AddPublish(std::string_view method, const DeltaOptions& delta, unsigned int queue_size = 10);
+
     template<typename Msg>
     void Publish(std::string_view method, const Msg& msg);
 
     template<typename Msg>
     void Publish(std::string_view method, Msg&& msg);
+
+    void Del(std::string_view method);
+
+    void SetPublishLimit(std::string_view method, const PublishLimit& limit);
+
+    //Serve PullPrefix for prefix ("/market/*"): publishes under it, added before or after, are also sent
+    //on its prefix channel. Publishes under no served prefix are not packed again.
+    void ServePrefix(std::string_view prefix, unsigned int queue_size = 10);
+
+    //Also serve the rpc and publishes to clients of this process at uri (inproc://name), without sockets.
+    //RemoteFunction with the same description as AddRpc moves its arguments and result, nothing is packed.
+    void ServeInproc(std::string_view uri);
+
+    //Record the raw rpc requests and publishes to path until StopCapture, replay it with amrpc_replay
+    void StartCapture(std::string_view path, const CaptureOptions& options = {});
+
+    void StopCapture();
+
+private:
+    void AddChannel(detail::MessageType, std::string_view method, std::string_view func_name,
+                    unsigned int queue_size);
+
+    //msg is the published value for inproc subscribers of its type
+    void Deliver(detail::MessageType, std::string_view method, std::string&& data,
+                 std::type_index msg_type = typeid(void), const void* msg = nullptr);
+
+    std::shared_ptr<detail::PublishRoutes> routes_ = std::make_shared<detail::PublishRoutes>();
+    std::shared_ptr<detail::Recorder> recorder_ = std::make_shared<detail::Recorder>();
+    std::shared_ptr<detail::InprocEndpoint> inproc_ = std::make_shared<detail::InprocEndpoint>();
 };
 }//amrpc
 
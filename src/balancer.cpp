@@ -0,0 +1,360 @@
+#include "amrpc.h"
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <optional>
+
+#include <ecv/net.h>
+#include <folly/Random.h>
+#include <folly/futures/Future.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+using Clock = chrono::steady_clock;
+
+constexpr double EWMA_ALPHA = 0.3;
+//traffic share of a host that has just come back
+constexpr double MIN_WEIGHT = 0.1;
+//unused hedge budget is kept up to this many calls
+constexpr double MAX_HEDGE_TOKENS = 10;
+//a transport error counts as a call this many times slower than the pool mean
+constexpr double ERROR_PENALTY = 4;
+
+//Errors thrown by the remote handler do not say anything about the host health
+bool IsTransportError(const folly::exception_wrapper& e) {
+    return e.is_compatible_with<ecv::net::Exception>() || e.is_compatible_with<folly::FutureTimeout>();
+}
+
+class Caller : public RawRemoteFunction {
+public:
+    using RawRemoteFunction::RawRemoteFunction;
+    using RawRemoteFunction::RawCall;
+};
+
+//Log-linear latency histogram over a sliding window of 2 periods, 8 buckets per power of 2.
+class LatencyHistogram {
+public:
+    void Add(double us, Clock::time_point now) {
+        Rotate(now);
+        ++current_[Index(us)];
+        ++current_count_;
+    }
+
+    [[nodiscard]] size_t Count(Clock::time_point now) {
+        Rotate(now);
+        return current_count_ + previous_count_;
+    }
+
+    //upper bound of the bucket holding the percentile
+    [[nodiscard]] double Percentile(double p) const {
+        auto target = p * static_cast<double>(current_count_ + previous_count_);
+        double sum = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            sum += current_[i] + previous_[i];
+            if (sum >= target) return Upper(i);
+        }
+        return Upper(BUCKETS - 1);
+    }
+
+private:
+    static constexpr size_t SUB = 8;
+    static constexpr size_t BUCKETS = 40 * SUB;
+    static constexpr Clock::duration PERIOD = chrono::seconds(10);
+
+    static size_t Index(double us) {
+        if (us < 1) return 0;
+        int exp;
+        auto mantissa = frexp(us, &exp); //us = mantissa * 2^exp, mantissa in [0.5,1)
+        auto index = static_cast<size_t>(exp) * SUB + static_cast<size_t>((mantissa - 0.5) * 2 * SUB);
+        return min(index, BUCKETS - 1);
+    }
+
+    static double Upper(size_t index) {
+        return ldexp(0.5 + static_cast<double>(index % SUB + 1) / (2 * SUB), static_cast<int>(index / SUB));
+    }
+
+    void Rotate(Clock::time_point now) {
+        if (now - rotated_ < PERIOD) return;
+        if (now - rotated_ < 2 * PERIOD) {
+            previous_ = current_;
+            previous_count_ = current_count_;
+        } else {
+            previous_.fill(0);
+            previous_count_ = 0;
+        }
+        current_.fill(0);
+        current_count_ = 0;
+        rotated_ = now;
+    }
+
+    array<uint32_t, BUCKETS> current_{};
+    array<uint32_t, BUCKETS> previous_{};
+    size_t current_count_ = 0;
+    size_t previous_count_ = 0;
+    Clock::time_point rotated_{};
+};
+
+//One hedged call, the first reply wins.
+//RawCall can not be interrupted, the other attempt runs to the end and its reply is ignored.
+struct Race : enable_shared_from_this<Race> {
+    template<typename Send>
+    void Join(Send&& send) {
+        lock_guard<mutex> lock(mtx);
+        if (done) return;
+        ++pending;
+        send().thenTry([self = shared_from_this()](folly::Try<string>&& t) {
+            self->Finish(move(t));
+        });
+    }
+
+    void Finish(folly::Try<string>&& t) {
+        {
+            lock_guard<mutex> lock(mtx);
+            --pending;
+            //a failed attempt waits for the other one
+            if (done || (t.hasException() && pending)) return;
+            done = true;
+        }
+        promise.setTry(move(t));
+    }
+
+    mutex mtx;
+    folly::Promise<string> promise;
+    unsigned int pending = 0;
+    atomic_bool done = {false};
+};
+}//namespace
+
+class Balancer::Impl : public enable_shared_from_this<Balancer::Impl> {
+public:
+    enum State {
+        HEALTHY = 0,
+        EJECTED,
+        WARMING
+    };
+
+    struct Endpoint {
+        Endpoint(string h, string_view method) : host(move(h)), func(host, method) {}
+
+        string host;
+        Caller func;
+        State state = HEALTHY;
+        unsigned int outstanding = 0;
+        unsigned int failures = 0;
+        double ewma = 0; //us
+        //no latency sample yet, the host is scored with the pool mean
+        bool sampled = false;
+        Clock::duration backoff{};
+        //EJECTED: next probe time, WARMING: recovered time
+        Clock::time_point since{};
+        bool probing = false;
+    };
+
+    Impl(vector<string>&& hosts, string_view method, const BalanceOptions& options)
+        : method_(method), options_(options) {
+        if (hosts.empty()) throw Exception("balancer: no host");
+        for (auto& host : hosts) endpoints_.emplace_back(make_unique<Endpoint>(move(host), method_));
+    }
+
+    folly::SemiFuture<folly::Unit> Enabled() {
+        vector<folly::Future<folly::Unit>> futures;
+        for (auto& ep : endpoints_) futures.emplace_back(ep->func.Enabled().via(&GetAmrpcExecutor()));
+        return folly::collectAnyWithoutException(futures.begin(), futures.end()).semi()
+            .deferValue([](pair<size_t, folly::Unit>&&) {});
+    }
+
+    folly::SemiFuture<string> Call(MessageType type, string&& raw) {
+        auto data = make_shared<const string>(move(raw));
+        auto delay = HedgeDelay();
+        auto first = Pick(nullopt);
+        if (!delay) return Send(first, type, data).semi();
+
+        auto race = make_shared<Race>();
+        auto res = race->promise.getSemiFuture();
+        race->Join([&]() { return Send(first, type, data); });
+        folly::futures::sleep(*delay).via(&GetAmrpcExecutor())
+            .thenValue([self = shared_from_this(), race, first, type, data](folly::Unit) {
+                //out of budget, keep waiting for the first attempt
+                if (race->done || !self->TakeHedgeToken()) return;
+                race->Join([&]() { return self->Send(self->Pick(first), type, data); });
+            });
+        return res;
+    }
+
+private:
+    size_t Pick(optional<size_t> exclude) {
+        auto now = Clock::now();
+        lock_guard<mutex> lock(mutex_);
+        auto mean = PoolMean();
+        candidates_.clear();
+        for (size_t i = 0; i < endpoints_.size(); ++i) {
+            auto& ep = *endpoints_[i];
+            if (ep.state == EJECTED) {
+                if (now >= ep.since && !ep.probing) Probe(i);
+                continue;
+            }
+            if (ep.state == WARMING && now >= ep.since + options_.warmup) ep.state = HEALTHY;
+            if (exclude != i) candidates_.push_back(i);
+        }
+
+        size_t index;
+        if (candidates_.empty()) {
+            //every host is ejected, spread the calls rather than fail all of them
+            index = exclude && endpoints_.size() == 1 ? *exclude : folly::Random::rand32(endpoints_.size());
+        } else if (candidates_.size() == 1) {
+            index = candidates_.front();
+        } else {
+            auto a = folly::Random::rand32(candidates_.size());
+            auto b = folly::Random::rand32(candidates_.size() - 1);
+            if (b >= a) ++b;
+            index = Score(candidates_[a], now, mean) <= Score(candidates_[b], now, mean) ? candidates_[a]
+                                                                                        : candidates_[b];
+        }
+        ++endpoints_[index]->outstanding;
+        return index;
+    }
+
+    folly::Future<string> Send(size_t index, MessageType type, const shared_ptr<const string>& data) {
+        auto start = Clock::now();
+        return folly::makeSemiFutureWith([&]() {
+            return endpoints_[index]->func.RawCall(type, *data);
+        }).via(&GetAmrpcExecutor()).thenTry(
+            [self = shared_from_this(), index, start, data](folly::Try<string>&& t) -> string {
+                //the loser of a race still completes, its latency or failure is counted like any other call
+                self->Done(index, start, t.hasException() ? &t.exception() : nullptr);
+                return move(t).value();
+            });
+    }
+
+    void Done(size_t index, Clock::time_point start, const folly::exception_wrapper* error) {
+        auto now = Clock::now();
+        lock_guard<mutex> lock(mutex_);
+        auto& ep = *endpoints_[index];
+        if (ep.outstanding) --ep.outstanding;
+        auto sample = chrono::duration<double, micro>(now - start).count();
+        if (error) {
+            if (!IsTransportError(*error)) return;
+            //a host failing fast must not look faster than the working ones
+            Sample(ep, max(sample, ERROR_PENALTY * PoolMean()));
+            if (++ep.failures >= options_.max_failures || ep.state == WARMING) Eject(ep, now);
+            return;
+        }
+        ep.failures = 0;
+        Sample(ep, sample);
+        if (options_.hedge) {
+            histogram_.Add(sample, now);
+            if (++samples_since_threshold_ >= 64) threshold_.reset();
+        }
+    }
+
+    //nullopt when the call should not be hedged
+    optional<Clock::duration> HedgeDelay() {
+        if (!options_.hedge) return nullopt;
+        lock_guard<mutex> lock(mutex_);
+        hedge_tokens_ = min(hedge_tokens_ + options_.hedge_budget, MAX_HEDGE_TOKENS);
+        if (hedge_tokens_ < 1 || histogram_.Count(Clock::now()) < options_.hedge_min_samples) return nullopt;
+        if (!threshold_) {
+            threshold_ = histogram_.Percentile(options_.hedge_percentile);
+            samples_since_threshold_ = 0;
+        }
+        return chrono::duration_cast<Clock::duration>(chrono::duration<double, micro>(*threshold_));
+    }
+
+    bool TakeHedgeToken() {
+        lock_guard<mutex> lock(mutex_);
+        if (hedge_tokens_ < 1) return false;
+        hedge_tokens_ -= 1;
+        return true;
+    }
+
+    //called with mutex_ held
+    static void Sample(Endpoint& ep, double us) {
+        ep.ewma = ep.sampled ? ep.ewma + EWMA_ALPHA * (us - ep.ewma) : us;
+        ep.sampled = true;
+    }
+
+    //called with mutex_ held, mean latency of the hosts with samples, 0 if there is none
+    double PoolMean() const {
+        double sum = 0;
+        size_t count = 0;
+        for (auto& ep : endpoints_) {
+            if (!ep->sampled) continue;
+            sum += ep->ewma;
+            ++count;
+        }
+        return count ? sum / static_cast<double>(count) : 0;
+    }
+
+    //lower is better
+    double Score(size_t index, Clock::time_point now, double mean) const {
+        auto& ep = *endpoints_[index];
+        double weight = 1.0;
+        if (ep.state == WARMING) {
+            weight = max(MIN_WEIGHT, chrono::duration<double>(now - ep.since) /
+                                     chrono::duration<double>(options_.warmup));
+        }
+        return (ep.outstanding + 1) * max(ep.sampled ? ep.ewma : mean, 1.0) / weight;
+    }
+
+    void Eject(Endpoint& ep, Clock::time_point now) {
+        if (ep.state == EJECTED) return;
+        ep.backoff = ep.state == WARMING ? min<Clock::duration>(ep.backoff * 2, options_.max_eject_interval)
+                                         : Clock::duration(options_.eject_interval);
+        ep.state = EJECTED;
+        ep.since = now + ep.backoff;
+        ep.failures = 0;
+    }
+
+    //called with mutex_ held
+    void Probe(size_t index) {
+        endpoints_[index]->probing = true;
+        folly::makeSemiFutureWith([&]() {
+            return endpoints_[index]->func.Enabled();
+        }).via(&GetAmrpcExecutor()).thenTry([self = shared_from_this(), index](folly::Try<folly::Unit>&& t) {
+            self->ProbeDone(index, t.hasValue());
+        });
+    }
+
+    void ProbeDone(size_t index, bool enabled) {
+        auto now = Clock::now();
+        lock_guard<mutex> lock(mutex_);
+        auto& ep = *endpoints_[index];
+        ep.probing = false;
+        if (ep.state != EJECTED) return;
+        if (enabled) {
+            ep.state = WARMING;
+            ep.since = now;
+        } else {
+            ep.backoff = min<Clock::duration>(ep.backoff * 2, options_.max_eject_interval);
+            ep.since = now + ep.backoff;
+        }
+    }
+
+    string method_;
+    BalanceOptions options_;
+    mutex mutex_;
+    vector<unique_ptr<Endpoint>> endpoints_;
+    vector<size_t> candidates_;
+    LatencyHistogram histogram_;
+    optional<double> threshold_;
+    unsigned int samples_since_threshold_ = 0;
+    double hedge_tokens_ = 0;
+};
+
+Balancer::Balancer(vector<string> hosts, string_view method, const BalanceOptions& options)
+    : pimpl_(make_shared<Impl>(move(hosts), method, options)) {}
+
+folly::SemiFuture<folly::Unit> Balancer::Enabled() {
+    return pimpl_->Enabled();
+}
+
+folly::SemiFuture<string> Balancer::Call(MessageType type, string&& data) const {
+    return pimpl_->Call(type, move(data));
+}
+
+}//amrpc::detail
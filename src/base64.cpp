@@ -0,0 +1,305 @@
+#include "amrpc.h"
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+constexpr char ENCODE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+constexpr uint8_t INVALID = 0xff;
+
+constexpr array<uint8_t, 256> MakeDecodeTable() {
+    array<uint8_t, 256> table{};
+    for (auto& v : table) v = INVALID;
+    for (uint8_t i = 0; i < 64; ++i) table[static_cast<uint8_t>(ENCODE[i])] = i;
+    return table;
+}
+
+constexpr auto DECODE = MakeDecodeTable();
+
+//Scalar codecs, the vector ones hand them the tail. They return the bytes written (or consumed).
+size_t EncodeScalar(const uint8_t* in, size_t size, char* out) {
+    auto start = out;
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        uint32_t v = (in[i] << 16u) | (in[i + 1] << 8u) | in[i + 2];
+        *out++ = ENCODE[v >> 18u];
+        *out++ = ENCODE[(v >> 12u) & 0x3fu];
+        *out++ = ENCODE[(v >> 6u) & 0x3fu];
+        *out++ = ENCODE[v & 0x3fu];
+    }
+    if (i < size) {
+        uint32_t v = in[i] << 16u;
+        if (i + 1 < size) v |= in[i + 1] << 8u;
+        *out++ = ENCODE[v >> 18u];
+        *out++ = ENCODE[(v >> 12u) & 0x3fu];
+        *out++ = i + 1 < size ? ENCODE[(v >> 6u) & 0x3fu] : '=';
+        *out++ = '=';
+    }
+    return out - start;
+}
+
+//size has no padding and size % 4 != 1, false on a character outside the alphabet
+bool DecodeScalar(const uint8_t* in, size_t size, uint8_t* out, size_t& written) {
+    auto start = out;
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        uint32_t a = DECODE[in[i]], b = DECODE[in[i + 1]], c = DECODE[in[i + 2]], d = DECODE[in[i + 3]];
+        if ((a | b | c | d) & 0xc0u) return false;
+        uint32_t v = (a << 18u) | (b << 12u) | (c << 6u) | d;
+        *out++ = v >> 16u;
+        *out++ = (v >> 8u) & 0xffu;
+        *out++ = v & 0xffu;
+    }
+    if (auto rest = size - i) {
+        uint32_t v = 0;
+        for (size_t j = 0; j < rest; ++j) {
+            auto d = DECODE[in[i + j]];
+            if (d == INVALID) return false;
+            v |= d << (18u - 6u * j);
+        }
+        *out++ = v >> 16u;
+        if (rest == 3) *out++ = (v >> 8u) & 0xffu;
+    }
+    written = out - start;
+    return true;
+}
+
+#if defined(__x86_64__)
+//Vector codecs after W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+//12 input bytes are spread into the 16 lanes of 6 bits each, then mapped to ASCII with one shuffle.
+__attribute__((target("ssse3")))
+__m128i EncodeLanes(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    auto t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    auto t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    auto indices = _mm_or_si128(t0, t1);
+    auto shift = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    shift = _mm_or_si128(shift, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    auto lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                             '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(lut, shift), indices);
+}
+
+__attribute__((target("ssse3")))
+size_t EncodeSsse3(const uint8_t* in, size_t size, char* out) {
+    size_t i = 0;
+    size_t o = 0;
+    //each load reads 16 bytes and uses 12
+    for (; i + 16 <= size; i += 12, o += 16) {
+        auto v = EncodeLanes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), v);
+    }
+    return o + EncodeScalar(in + i, size - i, out + o);
+}
+
+__attribute__((target("avx2")))
+size_t EncodeAvx2(const uint8_t* in, size_t size, char* out) {
+    size_t i = 0;
+    size_t o = 0;
+    //24 bytes in two lanes of 12, the second load reads 4 bytes past them
+    for (; i + 28 <= size; i += 24, o += 32) {
+        auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+        auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                                     1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+        auto t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                     _mm256_set1_epi32(0x04000040));
+        auto t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                     _mm256_set1_epi32(0x01000010));
+        auto indices = _mm256_or_si256(t0, t1);
+        auto shift = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+                                                        _mm256_set1_epi8(13)));
+        auto lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        v = _mm256_add_epi8(_mm256_shuffle_epi8(lut, shift), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), v);
+    }
+    return o + EncodeSsse3(in + i, size - i, out + o);
+}
+
+//16 characters are validated and mapped back to 6 bit values with nibble lookups, then packed into 12 bytes.
+//Returns false on a character outside the alphabet.
+__attribute__((target("ssse3")))
+bool DecodeLanes(__m128i in, __m128i& out) {
+    auto lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    auto lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    auto lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    auto hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    auto lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    auto lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    auto hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) return false;
+    auto roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi_nibbles));
+    auto values = _mm_add_epi8(in, roll);
+    auto merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+//out must have 4 bytes of slack after the decoded size
+__attribute__((target("ssse3")))
+bool DecodeSsse3(const uint8_t* in, size_t size, uint8_t* out, size_t& written) {
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 16 <= size; i += 16, o += 12) {
+        __m128i v;
+        if (!DecodeLanes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), v)) return false;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), v);
+    }
+    size_t rest = 0;
+    if (!DecodeScalar(in + i, size - i, out + o, rest)) return false;
+    written = o + rest;
+    return true;
+}
+
+//out must have 8 bytes of slack after the decoded size
+__attribute__((target("avx2")))
+bool DecodeAvx2(const uint8_t* in, size_t size, uint8_t* out, size_t& written) {
+    auto lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                   0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                   0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                   0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    auto lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                   0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    auto lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                     0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 32 <= size; i += 32, o += 24) {
+        auto in_v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in_v, 4), _mm256_set1_epi8(0x0f));
+        auto lo_nibbles = _mm256_and_si256(in_v, _mm256_set1_epi8(0x0f));
+        auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) return false;
+        auto eq_slash = _mm256_cmpeq_epi8(in_v, _mm256_set1_epi8('/'));
+        auto values = _mm256_add_epi8(in_v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles)));
+        auto merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), merged);
+    }
+    size_t rest = 0;
+    if (!DecodeSsse3(in + i, size - i, out + o, rest)) return false;
+    written = o + rest;
+    return true;
+}
+#endif
+
+using EncodeFunc = size_t (*)(const uint8_t*, size_t, char*);
+using DecodeFunc = bool (*)(const uint8_t*, size_t, uint8_t*, size_t&);
+
+struct Codec {
+    EncodeFunc encode;
+    DecodeFunc decode;
+};
+
+Codec GetCodec(Base64Tier tier) {
+#if defined(__x86_64__)
+    if (tier == BASE64_AVX2) return {EncodeAvx2, DecodeAvx2};
+    if (tier == BASE64_SSSE3) return {EncodeSsse3, DecodeSsse3};
+#endif
+    return {EncodeScalar, DecodeScalar};
+}
+
+//the widest codec the cpu runs
+const Codec& GetCodec() {
+    static const Codec codec = GetCodec(Base64Tiers().back());
+    return codec;
+}
+
+//room the vector decoders may write past the decoded bytes
+constexpr size_t DECODE_SLACK = 8;
+}//namespace
+
+vector<Base64Tier> Base64Tiers() {
+    vector<Base64Tier> tiers{BASE64_SCALAR};
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) tiers.push_back(BASE64_SSSE3);
+    if (__builtin_cpu_supports("avx2")) tiers.push_back(BASE64_AVX2);
+#endif
+    return tiers;
+}
+
+size_t Base64EncodedSize(size_t size) {
+    return (size + 2) / 3 * 4;
+}
+
+namespace {
+void Encode(const Codec& codec, string_view in, string& out) {
+    auto offset = out.size();
+    out.resize(offset + Base64EncodedSize(in.size()));
+    codec.encode(reinterpret_cast<const uint8_t*>(in.data()), in.size(), out.data() + offset);
+}
+
+bool Decode(const Codec& codec, string_view in, string& out) {
+    if (!in.empty() && in.back() == '=') in.remove_suffix(1);
+    if (!in.empty() && in.back() == '=') in.remove_suffix(1);
+    if (in.size() % 4 == 1) return false;
+    auto offset = out.size();
+    out.resize(offset + in.size() / 4 * 3 + 2 + DECODE_SLACK);
+    size_t written = 0;
+    if (!codec.decode(reinterpret_cast<const uint8_t*>(in.data()), in.size(),
+                      reinterpret_cast<uint8_t*>(out.data() + offset), written)) {
+        out.resize(offset);
+        return false;
+    }
+    out.resize(offset + written);
+    return true;
+}
+}//namespace
+
+void Base64Encode(string_view in, string& out) {
+    Encode(GetCodec(), in, out);
+}
+
+void Base64Encode(string_view in, string& out, Base64Tier tier) {
+    Encode(GetCodec(tier), in, out);
+}
+
+bool Base64Decode(string_view in, string& out) {
+    return Decode(GetCodec(), in, out);
+}
+
+bool Base64Decode(string_view in, string& out, Base64Tier tier) {
+    return Decode(GetCodec(tier), in, out);
+}
+
+namespace {
+thread_local bool json_bytes = false;
+}//namespace
+
+JsonBytesScope::JsonBytesScope() noexcept : previous_(json_bytes) {
+    json_bytes = true;
+}
+
+JsonBytesScope::~JsonBytesScope() {
+    json_bytes = previous_;
+}
+
+bool JsonBytesScope::Active() noexcept {
+    return json_bytes;
+}
+
+}//amrpc::detail
@@ -0,0 +1,49 @@
+#include "amrpc.h"
+
+#include <atomic>
+
+using namespace std;
+
+namespace amrpc {
+
+namespace {
+atomic<size_t> rpc_limit = {0};
+atomic<size_t> rpc_bytes = {0};
+atomic<size_t> rejected_rpcs = {0};
+atomic<size_t> dropped_publishes = {0};
+}//namespace
+
+void SetMemoryBudget(size_t bytes) {
+    rpc_limit.store(bytes, memory_order_relaxed);
+}
+
+MemoryUsage GetMemoryUsage() {
+    MemoryUsage usage;
+    usage.rpc_bytes = rpc_bytes.load(memory_order_relaxed);
+    usage.rejected_rpcs = rejected_rpcs.load(memory_order_relaxed);
+    usage.dropped_publishes = dropped_publishes.load(memory_order_relaxed);
+    return usage;
+}
+
+namespace detail {
+
+bool AcquireBudget(size_t bytes) {
+    auto used = rpc_bytes.fetch_add(bytes, memory_order_relaxed) + bytes;
+    auto limit = rpc_limit.load(memory_order_relaxed);
+    //a single request larger than the budget still gets through when nothing else is in flight
+    if (!limit || used <= limit || used == bytes) return true;
+    rpc_bytes.fetch_sub(bytes, memory_order_relaxed);
+    rejected_rpcs.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+void ReleaseBudget(size_t bytes) {
+    rpc_bytes.fetch_sub(bytes, memory_order_relaxed);
+}
+
+void CountDroppedPublish() {
+    dropped_publishes.fetch_add(1, memory_order_relaxed);
+}
+
+}//detail
+}//amrpc
@@ -0,0 +1,254 @@
+#include "amrpc.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+constexpr char MAGIC[8] = {'A', 'M', 'R', 'P', 'C', 'C', 'A', 'P'};
+constexpr uint32_t VERSION = 1;
+
+#pragma pack(push, 1)
+struct RecordHeader {
+    uint8_t kind;
+    uint8_t type;
+    uint16_t method_size;
+    uint32_t payload_size;
+    int64_t time; //ns since the capture started
+};
+#pragma pack(pop)
+}//namespace
+
+/////////////////////////////////////////////////////////
+// Recorder
+// Records are copied into preallocated buffers, full buffers are written by a background thread.
+// Space is reserved under the lock and filled after it. When every buffer is waiting for the disk
+// the record is dropped and counted.
+/////////////////////////////////////////////////////////
+class Recorder::Impl {
+public:
+    ~Impl() {
+        Stop();
+    }
+
+    void Start(string_view path, const CaptureOptions& options) {
+        lock_guard<mutex> lock(mutex_);
+        if (active_) throw Exception("capture: already started");
+        file_ = fopen(string(path).c_str(), "wb");
+        if (!file_) throw Exception("capture: open " + string(path) + " failed");
+        fwrite(MAGIC, 1, sizeof(MAGIC), file_);
+        fwrite(&VERSION, sizeof(VERSION), 1, file_);
+        buffer_size_ = options.buffer_size;
+        for (unsigned int i = 1; i < max(options.buffers, 2u); ++i) free_.push_back(make_unique<Buffer>(buffer_size_));
+        current_ = make_unique<Buffer>(buffer_size_);
+        dropped_ = 0;
+        start_ = chrono::steady_clock::now();
+        stopping_ = false;
+        writer_ = thread([this]() { Write(); });
+        active_ = true;
+    }
+
+    void Stop() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!active_) return;
+            active_ = false;
+            if (current_ && current_->size) queue_.push_back(move(current_));
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        writer_.join();
+        fclose(file_);
+        file_ = nullptr;
+        current_.reset();
+        free_.clear();
+    }
+
+    [[nodiscard]] bool Active() const {
+        return active_.load(memory_order_relaxed);
+    }
+
+    [[nodiscard]] size_t Dropped() const {
+        return dropped_.load(memory_order_relaxed);
+    }
+
+    void Record(CaptureKind kind, MessageType type, string_view method, string_view payload) {
+        if (!active_) return;
+        if (method.size() > numeric_limits<uint16_t>::max() || payload.size() > numeric_limits<uint32_t>::max()) {
+            ++dropped_;
+            LOG_EVERY_N(ERROR, 1000) << "capture: record of " << method.substr(0, 64) << " dropped, method over "
+                                     << numeric_limits<uint16_t>::max() << " or payload over "
+                                     << numeric_limits<uint32_t>::max() << " bytes";
+            return;
+        }
+        auto time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+        RecordHeader header{static_cast<uint8_t>(kind), static_cast<uint8_t>(type),
+                            static_cast<uint16_t>(method.size()), static_cast<uint32_t>(payload.size()), time};
+        size_t size = sizeof(header) + method.size() + payload.size();
+        //a record larger than a buffer gets one of its own, it is freed once written
+        auto own = size > buffer_size_ ? make_unique<Buffer>(size) : nullptr;
+        Buffer* buffer = nullptr;
+        size_t offset = 0;
+        bool notify = false;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!active_) return;
+            if (current_ && current_->size && (own || current_->size + size > current_->capacity)) {
+                queue_.push_back(move(current_));
+                notify = true;
+            }
+            if (!current_ && !free_.empty()) {
+                current_ = move(free_.front());
+                free_.pop_front();
+            }
+            if (!current_) {
+                ++dropped_;
+            } else if (own) {
+                buffer = own.get();
+                buffer->size = size;
+                ++buffer->copying;
+                queue_.push_back(move(own));
+                notify = true;
+            } else {
+                buffer = current_.get();
+                offset = buffer->size;
+                buffer->size += size;
+                ++buffer->copying;
+            }
+        }
+        if (buffer) {
+            char* p = buffer->data.get() + offset;
+            memcpy(p, &header, sizeof(header));
+            memcpy(p + sizeof(header), method.data(), method.size());
+            memcpy(p + sizeof(header) + method.size(), payload.data(), payload.size());
+            buffer->copying.fetch_sub(1, memory_order_release);
+        }
+        if (notify) cv_.notify_one();
+    }
+
+private:
+    struct Buffer {
+        explicit Buffer(size_t capacity) : data(new char[capacity]), capacity(capacity) {}
+
+        unique_ptr<char[]> data;
+        size_t capacity;
+        //bytes reserved
+        size_t size = 0;
+        //records reserved but still being copied
+        atomic<unsigned int> copying = {0};
+    };
+
+    void Write() {
+        PlaceThread(THREAD_BACKGROUND, "amrpc_capture");
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() { return !queue_.empty() || stopping_; });
+            if (queue_.empty()) return;
+            auto buffer = move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            //records reserved before the buffer was queued may still be copying
+            while (buffer->copying.load(memory_order_acquire)) this_thread::yield();
+            fwrite(buffer->data.get(), 1, buffer->size, file_);
+            lock.lock();
+            if (buffer->capacity == buffer_size_) {
+                buffer->size = 0;
+                free_.push_back(move(buffer));
+            }
+        }
+    }
+
+    mutex mutex_;
+    condition_variable cv_;
+    atomic_bool active_ = {false};
+    atomic<size_t> dropped_ = {0};
+    bool stopping_ = false;
+    FILE* file_ = nullptr;
+    size_t buffer_size_ = 0;
+    //null while every buffer waits for the disk
+    unique_ptr<Buffer> current_;
+    deque<unique_ptr<Buffer>> free_;
+    deque<unique_ptr<Buffer>> queue_;
+    chrono::steady_clock::time_point start_;
+    thread writer_;
+};
+
+Recorder::Recorder() : pimpl_(make_shared<Impl>()) {}
+
+void Recorder::Start(string_view path, const CaptureOptions& options) {
+    pimpl_->Start(path, options);
+}
+
+void Recorder::Stop() {
+    pimpl_->Stop();
+}
+
+bool Recorder::Active() const {
+    return pimpl_->Active();
+}
+
+size_t Recorder::Dropped() const {
+    return pimpl_->Dropped();
+}
+
+void Recorder::Record(CaptureKind kind, MessageType type, string_view method, string_view payload) {
+    pimpl_->Record(kind, type, method, payload);
+}
+
+/////////////////////////////////////////////////////////
+// CaptureReader
+/////////////////////////////////////////////////////////
+class CaptureReader::Impl {
+public:
+    explicit Impl(string_view path) : file_(fopen(string(path).c_str(), "rb")) {
+        if (!file_) throw Exception("capture: open " + string(path) + " failed");
+        char magic[sizeof(MAGIC)];
+        uint32_t version = 0;
+        if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            fread(&version, sizeof(version), 1, file_) != 1 || version != VERSION) {
+            fclose(file_);
+            throw Exception("capture: " + string(path) + " is not a capture file");
+        }
+    }
+
+    ~Impl() {
+        fclose(file_);
+    }
+
+    bool Next(CaptureRecord& record) {
+        RecordHeader header{};
+        if (fread(&header, sizeof(header), 1, file_) != 1) return false;
+        record.kind = static_cast<CaptureKind>(header.kind);
+        record.type = static_cast<MessageType>(header.type);
+        record.time = chrono::nanoseconds(header.time);
+        record.method.resize(header.method_size);
+        record.payload.resize(header.payload_size);
+        if (fread(record.method.data(), 1, record.method.size(), file_) != record.method.size() ||
+            fread(record.payload.data(), 1, record.payload.size(), file_) != record.payload.size()) {
+            throw Exception("capture: truncated record");
+        }
+        return true;
+    }
+
+private:
+    FILE* file_;
+};
+
+CaptureReader::CaptureReader(string_view path) : pimpl_(make_shared<Impl>(path)) {}
+
+bool CaptureReader::Next(CaptureRecord& record) {
+    return pimpl_->Next(record);
+}
+
+}//amrpc::detail
@@ -0,0 +1,46 @@
+#include "amrpc.h"
+
+#include <mutex>
+#include <unordered_map>
+
+#include <folly/futures/Future.h>
+#include <folly/futures/SharedPromise.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+RawRpc Coalesce(RawRpc&& func) {
+    using Flight = folly::SharedPromise<string>;
+    struct State {
+        mutex mtx;
+        unordered_map<string, shared_ptr<Flight>> flights;
+    };
+    auto state = make_shared<State>();
+
+    return [state, func{move(func)}](string&& raw) -> folly::SemiFuture<string> {
+        shared_ptr<Flight> flight;
+        const string* key = nullptr;
+        {
+            lock_guard<mutex> lock(state->mtx);
+            auto[it, leader] = state->flights.try_emplace(raw);
+            if (!leader) return it->second->getSemiFuture();
+            it->second = flight = make_shared<Flight>();
+            //node based map, the key address is stable until erased
+            key = &it->first;
+        }
+        auto res = flight->getSemiFuture();
+        folly::makeSemiFutureWith([&func, &raw]() {
+            return func(move(raw));
+        }).via(&GetAmrpcExecutor()).thenTry([state, flight, key](folly::Try<string>&& t) {
+            {
+                lock_guard<mutex> lock(state->mtx);
+                state->flights.erase(state->flights.find(*key));
+            }
+            flight->setTry(move(t));
+        });
+        return res;
+    };
+}
+
+}//amrpc::detail
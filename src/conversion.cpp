@@ -1,9 +1,9 @@
 #include "conversion.h"
+#include "amrpc.h"
 
 #include <boost/endian/buffers.hpp>
 #include <folly/json.h>
 #include <folly/dynamic.h>
-#include <ecv/strings.h>
 #include <msgpack.hpp>
 
 using namespace std;
@@ -15,13 +15,16 @@ public:
     explicit MsgPackObjVisitor(ostream& os) : object_stringize_visitor(os), os_(os) {}
 
     bool visit_bin(const char* v, uint32_t size) {
-        auto base64 = ecv::Base64Encode({v, size});
-        (os_ << '"').write(base64.data(), static_cast<std::streamsize>(base64.size())) << '"';
+        base64_.clear();
+        amrpc::detail::Base64Encode({v, size}, base64_);
+        (os_ << '"').write(base64_.data(), static_cast<std::streamsize>(base64_.size())) << '"';
         return true;
     }
 
 private:
     std::ostream& os_;
+    //reused by every bin of the message
+    std::string base64_;
 };
 
 template<typename NUM>
@@ -154,4 +157,12 @@ std::string Json2Msgpack(std::string_view json_bin) {
     return msgpack_bin;
 }
 
-} //amrpc::util
\ No newline at end of file
+} //amrpc::util
+
+namespace amrpc::detail {
+
+std::string JsonToMsgpack(std::string_view json) {
+    return util::Json2Msgpack(json);
+}
+
+}//amrpc::detail
\ No newline at end of file
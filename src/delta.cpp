@@ -0,0 +1,281 @@
+#include "amrpc.h"
+
+#include <algorithm>
+#include <mutex>
+#include <optional>
+
+#include <folly/futures/Future.h>
+#include <msgpack.hpp>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+constexpr string_view KEYFRAME_PREFIX = "/amrpc/keyframe";
+
+//A frame is [seq, keyframe, {field: value}], a keyframe carries every field, a delta the changed ones
+using Packer = msgpack::packer<StringBuffer>;
+
+void PackFrameHead(Packer& packer, uint64_t seq, bool keyframe, uint32_t fields) {
+    packer.pack_array(3);
+    packer.pack(seq);
+    packer.pack(keyframe);
+    packer.pack_map(fields);
+}
+
+const msgpack::object_map& AsMap(const msgpack::object& obj) {
+    if (obj.type != msgpack::type::MAP) throw Exception("delta publish: message is not an AMRPC_DEFINE struct");
+    return obj.via.map;
+}
+
+//Client side of PullDelta: keeps the last message as packed fields and merges the frames into it.
+class DeltaStream : public enable_shared_from_this<DeltaStream> {
+public:
+    using Callback = function<void(folly::Try<string>&&)>;
+
+    DeltaStream(string_view host, string_view method, Callback&& func)
+        : host_(host), keyframe_method_(KeyframeMethod(method)), func_(move(func)),
+          keyframe_(host_, keyframe_method_) {}
+
+    //a new subscriber starts from the last message
+    void Start() {
+        lock_guard<mutex> lock(mutex_);
+        Resync();
+    }
+
+    void Live(folly::Try<string>&& t) {
+        unique_lock<mutex> lock(mutex_);
+        if (t.hasException()) {
+            ready_.push_back(move(t));
+            Drain(lock);
+            return;
+        }
+        Frame frame;
+        try {
+            frame.oh = UnpackHandle(move(t).value());
+            auto& obj = frame.oh->get();
+            if (obj.type != msgpack::type::ARRAY || obj.via.array.size != 3) throw Exception("not a frame");
+            frame.seq = obj.via.array.ptr[0].as<uint64_t>();
+            frame.keyframe = obj.via.array.ptr[1].as<bool>();
+            AsMap(obj.via.array.ptr[2]);
+        } catch (exception& e) {
+            ready_.emplace_back(folly::make_exception_wrapper<Exception>(string("bad delta frame: ") + e.what()));
+            Drain(lock);
+            return;
+        }
+        if (resyncing_) {
+            buffer_.push_back(move(frame));
+        } else if (!Apply(frame)) {
+            buffer_.push_back(move(frame));
+            Resync();
+        }
+        Drain(lock);
+    }
+
+private:
+    struct Frame {
+        uint64_t seq = 0;
+        bool keyframe = false;
+        shared_ptr<msgpack::object_handle> oh;
+
+        [[nodiscard]] const msgpack::object_map& Fields() const { return oh->get().via.array.ptr[2].via.map; }
+    };
+
+    //called with mutex_ held
+    void Resync() {
+        resyncing_ = true;
+        keyframe_().via(&GetAmrpcExecutor()).thenTry([weak = weak_from_this()](folly::Try<Keyframe>&& t) {
+            if (auto self = weak.lock()) self->Resynced(move(t));
+        });
+    }
+
+    void Resynced(folly::Try<Keyframe>&& t) {
+        unique_lock<mutex> lock(mutex_);
+        resyncing_ = false;
+        if (t.hasException()) {
+            //wait for the next keyframe of the live stream
+            ready_.emplace_back(t.exception());
+            buffer_.erase(remove_if(buffer_.begin(), buffer_.end(), [](const Frame& f) { return !f.keyframe; }),
+                          buffer_.end());
+        } else if (t.value().seq > seq_) {
+            try {
+                auto oh = UnpackHandle(move(t.value().message));
+                auto& fields = AsMap(oh->get());
+                fields_.clear();
+                Merge(fields);
+                seq_ = t.value().seq;
+                Emit();
+            } catch (exception& e) {
+                ready_.emplace_back(folly::make_exception_wrapper<Exception>(string("bad keyframe: ") + e.what()));
+            }
+        }
+        sort(buffer_.begin(), buffer_.end(), [](const Frame& a, const Frame& b) { return a.seq < b.seq; });
+        size_t i = 0;
+        for (; i < buffer_.size() && Apply(buffer_[i]); ++i);
+        buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<ptrdiff_t>(i));
+        if (!buffer_.empty() && t.hasValue()) Resync();
+        Drain(lock);
+    }
+
+    //Hands the messages made ready under the lock to the callback, in order and outside the lock.
+    //One thread drains at a time, the others leave their messages to it.
+    void Drain(unique_lock<mutex>& lock) {
+        if (draining_) return;
+        draining_ = true;
+        while (!ready_.empty()) {
+            auto ready = move(ready_);
+            ready_.clear();
+            lock.unlock();
+            for (auto& t : ready) func_(move(t));
+            lock.lock();
+        }
+        draining_ = false;
+    }
+
+    //called with mutex_ held, false when the frame does not follow the last message
+    bool Apply(const Frame& frame) {
+        if (frame.seq <= seq_) return true;
+        if (!frame.keyframe && frame.seq != seq_ + 1) return false;
+        if (frame.keyframe) fields_.clear();
+        Merge(frame.Fields());
+        seq_ = frame.seq;
+        Emit();
+        return true;
+    }
+
+    void Merge(const msgpack::object_map& fields) {
+        for (uint32_t i = 0; i < fields.size; ++i) {
+            auto& kv = fields.ptr[i];
+            auto key = kv.key.as<string>();
+            auto value = PackToString(kv.val);
+            auto it = find_if(fields_.begin(), fields_.end(), [&key](const auto& f) { return f.first == key; });
+            if (it == fields_.end()) {
+                fields_.emplace_back(move(key), move(value));
+            } else {
+                it->second = move(value);
+            }
+        }
+    }
+
+    void Emit() {
+        StringBuffer buffer;
+        buffer.data.reserve(PACK_INIT_SIZE);
+        Packer packer(buffer);
+        packer.pack_map(static_cast<uint32_t>(fields_.size()));
+        for (auto&[key, value] : fields_) {
+            packer.pack(key);
+            buffer.write(value.data(), value.size());
+        }
+        ready_.emplace_back(move(buffer.data));
+    }
+
+    string host_;
+    string keyframe_method_;
+    Callback func_;
+    mutex mutex_;
+    //seq of the last message delivered, 0 before the first one
+    uint64_t seq_ = 0;
+    //the last message, field name -> packed value, in the order of the server
+    vector<pair<string, string>> fields_;
+    //live frames are buffered while the last message is fetched
+    bool resyncing_ = false;
+    vector<Frame> buffer_;
+    //messages for func_, delivered by Drain
+    vector<folly::Try<string>> ready_;
+    bool draining_ = false;
+    RemoteFunction<Keyframe()> keyframe_;
+};
+}//namespace
+
+string KeyframeMethod(string_view method) {
+    return string(KEYFRAME_PREFIX) + string(method);
+}
+
+class DeltaEncoder::Impl {
+public:
+    explicit Impl(const DeltaOptions& options) : options_(options) {}
+
+    void Encode(string&& packed, const function<void(string&&)>& publish) {
+        auto oh = msgpack::unpack(packed.data(), packed.size());
+        auto& fields = AsMap(oh.get());
+        StringBuffer buffer;
+        buffer.data.reserve(PACK_INIT_SIZE);
+        Packer packer(buffer);
+
+        lock_guard<mutex> lock(mutex_);
+        auto seq = ++seq_;
+        if (!last_ || ++since_keyframe_ >= max(options_.keyframe_interval, 1u) || !SameFields(fields)) {
+            since_keyframe_ = 0;
+            PackFrameHead(packer, seq, true, fields.size);
+            for (uint32_t i = 0; i < fields.size; ++i) {
+                packer.pack(fields.ptr[i].key);
+                packer.pack(fields.ptr[i].val);
+            }
+        } else {
+            auto& last = last_->get().via.map;
+            changed_.clear();
+            for (uint32_t i = 0; i < fields.size; ++i) {
+                if (!(fields.ptr[i].val == last.ptr[i].val)) changed_.push_back(i);
+            }
+            PackFrameHead(packer, seq, false, static_cast<uint32_t>(changed_.size()));
+            for (auto i : changed_) {
+                packer.pack(fields.ptr[i].key);
+                packer.pack(fields.ptr[i].val);
+            }
+        }
+        last_ = move(oh);
+        last_packed_ = move(packed);
+        publish(move(buffer.data));
+    }
+
+    Keyframe Snapshot() {
+        Keyframe keyframe;
+        lock_guard<mutex> lock(mutex_);
+        keyframe.seq = seq_;
+        keyframe.message = Bytes(last_packed_);
+        return keyframe;
+    }
+
+private:
+    //called with mutex_ held, fields are compared by position so the key lists must match
+    bool SameFields(const msgpack::object_map& fields) const {
+        auto& last = last_->get().via.map;
+        if (last.size != fields.size) return false;
+        for (uint32_t i = 0; i < fields.size; ++i) {
+            if (!(fields.ptr[i].key == last.ptr[i].key)) return false;
+        }
+        return true;
+    }
+
+    DeltaOptions options_;
+    mutex mutex_;
+    uint64_t seq_ = 0;
+    unsigned int since_keyframe_ = 0;
+    optional<msgpack::object_handle> last_;
+    string last_packed_;
+    vector<uint32_t> changed_;
+};
+
+DeltaEncoder::DeltaEncoder(const DeltaOptions& options) : pimpl_(make_shared<Impl>(options)) {}
+
+void DeltaEncoder::Encode(string&& packed, const function<void(string&&)>& publish) {
+    pimpl_->Encode(move(packed), publish);
+}
+
+Keyframe DeltaEncoder::Snapshot() const {
+    return pimpl_->Snapshot();
+}
+
+folly::SemiFuture<Puller> PullDelta(string_view host, string_view method,
+                                    function<void(folly::Try<string>&&)>&& func) {
+    auto stream = make_shared<DeltaStream>(host, method, move(func));
+    return Puller::Create(MSGPACK, host, method, [stream](folly::Try<string>&& t) {
+        stream->Live(move(t));
+    }).deferValue([stream](Puller&& puller) {
+        stream->Start();
+        return move(puller);
+    });
+}
+
+}//amrpc::detail
@@ -0,0 +1,340 @@
+#include "amrpc.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <folly/futures/Future.h>
+#include <msgpack.hpp>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+using Clock = chrono::steady_clock;
+
+constexpr string_view HISTORY_PREFIX = "/amrpc/history";
+constexpr string_view SEQ_PREFIX = "/amrpc/seq";
+
+struct RecordHeader {
+    uint64_t seq;
+    int64_t time; //steady clock, ns
+    uint32_t size;
+    uint32_t reserved;
+};
+
+size_t RecordSize(size_t payload) {
+    return sizeof(RecordHeader) + ((payload + 7) & ~size_t(7));
+}
+
+//A file mapped append-only run of records. The file is unlinked at once, nothing is left after a crash.
+class Segment : ecv::MoveOnly {
+public:
+    Segment(const string& dir, size_t capacity) : capacity_(capacity) {
+        auto path = dir + "/amrpc_history_XXXXXX";
+        int fd = mkstemp(path.data());
+        if (fd < 0) throw Exception("history: create segment in " + dir + " failed");
+        unlink(path.c_str());
+        if (ftruncate(fd, static_cast<off_t>(capacity)) != 0) {
+            close(fd);
+            throw Exception("history: allocate segment failed");
+        }
+        auto addr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) throw Exception("history: map segment failed");
+        data_ = static_cast<char*>(addr);
+    }
+
+    ~Segment() {
+        munmap(data_, capacity_);
+    }
+
+    bool Append(uint64_t seq, int64_t time, string_view payload) {
+        auto size = RecordSize(payload.size());
+        if (used_ + size > capacity_) return false;
+        RecordHeader header{seq, time, static_cast<uint32_t>(payload.size()), 0};
+        memcpy(data_ + used_, &header, sizeof(header));
+        memcpy(data_ + used_ + sizeof(header), payload.data(), payload.size());
+        if (offsets_.empty()) first_ = seq;
+        offsets_.push_back(used_);
+        last_time_ = time;
+        used_ += size;
+        return true;
+    }
+
+    [[nodiscard]] uint64_t First() const { return first_; }
+
+    [[nodiscard]] uint64_t End() const { return first_ + offsets_.size(); }
+
+    [[nodiscard]] int64_t LastTime() const { return last_time_; }
+
+    [[nodiscard]] RecordHeader Header(uint64_t seq) const {
+        RecordHeader header{};
+        memcpy(&header, data_ + offsets_[seq - first_], sizeof(header));
+        return header;
+    }
+
+    [[nodiscard]] string_view Payload(uint64_t seq) const {
+        auto offset = offsets_[seq - first_];
+        return {data_ + offset + sizeof(RecordHeader), Header(seq).size};
+    }
+
+private:
+    char* data_ = nullptr;
+    size_t capacity_;
+    size_t used_ = 0;
+    vector<size_t> offsets_;
+    uint64_t first_ = 0;
+    int64_t last_time_ = 0;
+};
+
+//Client side of PullFrom: buffers the live stream while the history is fetched,
+//then delivers both in seq order without gaps or duplicates.
+class Catchup : public enable_shared_from_this<Catchup> {
+public:
+    using Callback = function<void(folly::Try<string>&&, uint64_t)>;
+
+    Catchup(string_view host, string_view method, uint64_t from, Callback&& func)
+        : host_(host), history_method_(HistoryMethod(method)), seq_method_(SeqMethod(method)),
+          func_(move(func)), next_(from), history_(host_, history_method_) {}
+
+    [[nodiscard]] string_view Method() const { return seq_method_; }
+
+    void Start() {
+        lock_guard<mutex> lock(mutex_);
+        Fetch();
+    }
+
+    void Live(folly::Try<string>&& t) {
+        unique_lock<mutex> lock(mutex_);
+        if (t.hasException()) {
+            ready_.emplace_back(move(t), next_);
+            Dispatch(lock);
+            return;
+        }
+        uint64_t seq;
+        Bytes payload;
+        try {
+            auto oh = msgpack::unpack(t.value().data(), t.value().size());
+            tie(seq, payload) = oh.get().as<tuple<uint64_t, Bytes>>();
+        } catch (exception& e) {
+            ready_.emplace_back(folly::make_exception_wrapper<Exception>(string("bad history frame: ") + e.what()),
+                                next_);
+            Dispatch(lock);
+            return;
+        }
+        if (catching_up_ || seq > next_) {
+            buffer_.emplace_back(seq, move(payload));
+            if (!catching_up_) Fetch();
+        } else if (seq == next_) {
+            Deliver(seq, move(payload));
+        }
+        Dispatch(lock);
+    }
+
+private:
+    //called with mutex_ held
+    void Fetch() {
+        catching_up_ = true;
+        history_(uint64_t(next_)).via(&GetAmrpcExecutor()).thenTry(
+            [weak = weak_from_this()](folly::Try<HistoryBatch>&& t) {
+                if (auto self = weak.lock()) self->Fetched(move(t));
+            });
+    }
+
+    void Fetched(folly::Try<HistoryBatch>&& t) {
+        unique_lock<mutex> lock(mutex_);
+        if (t.hasException()) {
+            //history is not available, go on with the live stream
+            ready_.emplace_back(folly::Try<string>(t.exception()), next_);
+            Drain(true);
+            Dispatch(lock);
+            return;
+        }
+        auto& batch = t.value();
+        for (size_t i = 0; i < batch.seqs.size(); ++i) {
+            if (batch.seqs[i] >= next_) Deliver(batch.seqs[i], move(batch.payloads[i]));
+        }
+        if (!batch.seqs.empty() && next_ < batch.next) {
+            Fetch();
+            Dispatch(lock);
+            return;
+        }
+        //anything before batch.next that was not returned has been dropped from the history,
+        //but may still be in the live buffer
+        auto end = batch.next;
+        for (auto& buffered : buffer_) end = min(end, buffered.first);
+        next_ = max(next_, end);
+        Drain(false);
+        Dispatch(lock);
+    }
+
+    //called with mutex_ held, a gap left in the buffer is fetched again unless skipped
+    void Drain(bool skip_gap) {
+        sort(buffer_.begin(), buffer_.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        if (skip_gap && !buffer_.empty()) next_ = max(next_, buffer_.front().first);
+        size_t i = 0;
+        for (; i < buffer_.size(); ++i) {
+            auto&[seq, payload] = buffer_[i];
+            if (seq > next_) break;
+            if (seq == next_) Deliver(seq, move(payload));
+        }
+        buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<ptrdiff_t>(i));
+        if (buffer_.empty()) {
+            catching_up_ = false;
+        } else {
+            Fetch();
+        }
+    }
+
+    //called with mutex_ held
+    void Deliver(uint64_t seq, string&& payload) {
+        next_ = seq + 1;
+        ready_.emplace_back(folly::Try<string>(move(payload)), seq);
+    }
+
+    //Hands the messages made ready under the lock to the callback, in order and outside the lock.
+    //One thread dispatches at a time, the others leave their messages to it.
+    void Dispatch(unique_lock<mutex>& lock) {
+        if (dispatching_) return;
+        dispatching_ = true;
+        while (!ready_.empty()) {
+            auto ready = move(ready_);
+            ready_.clear();
+            lock.unlock();
+            for (auto&[t, seq] : ready) func_(move(t), seq);
+            lock.lock();
+        }
+        dispatching_ = false;
+    }
+
+    string host_;
+    string history_method_;
+    string seq_method_;
+    Callback func_;
+    mutex mutex_;
+    uint64_t next_;
+    //live messages are buffered until the first fetch is done
+    bool catching_up_ = true;
+    vector<pair<uint64_t, string>> buffer_;
+    //messages for func_, delivered by Dispatch
+    vector<pair<folly::Try<string>, uint64_t>> ready_;
+    bool dispatching_ = false;
+    RemoteFunction<HistoryBatch(uint64_t)> history_;
+};
+}//namespace
+
+string HistoryMethod(string_view method) {
+    return string(HISTORY_PREFIX) + string(method);
+}
+
+string SeqMethod(string_view method) {
+    return string(SEQ_PREFIX) + string(method);
+}
+
+class HistoryLog::Impl {
+public:
+    Impl(string_view method, const HistoryOptions& options) : seq_method_(SeqMethod(method)), options_(options) {}
+
+    void Append(string_view data, const function<void(uint64_t)>& publish) {
+        auto now = Clock::now().time_since_epoch().count();
+        //publishers go one at a time so frames leave in seq order, readers only wait for the append
+        lock_guard<mutex> order(publish_mutex_);
+        uint64_t seq;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (segments_.empty() || !segments_.back()->Append(next_, now, data)) {
+                auto capacity = max(options_.segment_size, RecordSize(data.size()));
+                segments_.emplace_back(make_unique<Segment>(options_.dir, capacity));
+                segments_.back()->Append(next_, now, data);
+            }
+            Trim(now);
+            seq = next_++;
+        }
+        publish(seq);
+    }
+
+    HistoryBatch Read(uint64_t from) {
+        auto now = Clock::now().time_since_epoch().count();
+        HistoryBatch batch;
+        lock_guard<mutex> lock(mutex_);
+        Trim(now);
+        batch.next = next_;
+        size_t bytes = 0;
+        for (auto& segment : segments_) {
+            for (auto seq = max({from, first_, segment->First()}); seq < segment->End(); ++seq) {
+                if (bytes >= options_.batch_size) return batch;
+                auto payload = segment->Payload(seq);
+                bytes += payload.size();
+                batch.seqs.push_back(seq);
+                batch.payloads.emplace_back(payload);
+            }
+        }
+        return batch;
+    }
+
+    [[nodiscard]] string_view Method() const { return seq_method_; }
+
+private:
+    //called with mutex_ held
+    void Trim(int64_t now) {
+        if (options_.max_messages && next_ - first_ > options_.max_messages) first_ = next_ - options_.max_messages;
+        if (options_.max_age.count()) {
+            auto cutoff = now - chrono::duration_cast<Clock::duration>(options_.max_age).count();
+            for (auto& segment : segments_) {
+                if (segment->LastTime() >= cutoff) {
+                    while (first_ < segment->End() && segment->Header(max(first_, segment->First())).time < cutoff) {
+                        first_ = max(first_, segment->First()) + 1;
+                    }
+                    break;
+                }
+                first_ = max(first_, segment->End());
+            }
+        }
+        while (!segments_.empty() && segments_.front()->End() <= first_) segments_.pop_front();
+    }
+
+    string seq_method_;
+    HistoryOptions options_;
+    //serializes Append and its publish, held before mutex_
+    mutex publish_mutex_;
+    mutex mutex_;
+    deque<unique_ptr<Segment>> segments_;
+    //retained messages are [first_, next_)
+    uint64_t first_ = 0;
+    uint64_t next_ = 0;
+};
+
+HistoryLog::HistoryLog(string_view method, const HistoryOptions& options)
+    : pimpl_(make_shared<Impl>(method, options)) {}
+
+void HistoryLog::Append(string_view data, const function<void(uint64_t)>& publish) {
+    pimpl_->Append(data, publish);
+}
+
+HistoryBatch HistoryLog::Read(uint64_t from) const {
+    return pimpl_->Read(from);
+}
+
+string_view HistoryLog::SeqMethod() const {
+    return pimpl_->Method();
+}
+
+folly::SemiFuture<Puller> PullHistory(string_view host, string_view method, uint64_t from,
+                                      function<void(folly::Try<string>&&, uint64_t)>&& func) {
+    auto catchup = make_shared<Catchup>(host, method, from, move(func));
+    return Puller::Create(MSGPACK, host, catchup->Method(), [catchup](folly::Try<string>&& t) {
+        catchup->Live(move(t));
+    }).deferValue([catchup](Puller&& puller) {
+        catchup->Start();
+        return move(puller);
+    });
+}
+
+}//amrpc::detail
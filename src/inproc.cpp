@@ -0,0 +1,184 @@
+#include "amrpc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include <folly/futures/Future.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+constexpr string_view INPROC_SCHEME = "inproc://";
+
+//inproc:// uri -> the endpoint listening on it
+struct Registry {
+    shared_mutex mutex;
+    map<string, weak_ptr<InprocEndpoint>, less<>> endpoints;
+};
+
+//never destroyed, servers may be destroyed during shutdown
+Registry& GetRegistry() {
+    static auto registry = new Registry();
+    return *registry;
+}
+}//namespace
+
+bool IsInproc(string_view host) {
+    return host.rfind(INPROC_SCHEME, 0) == 0;
+}
+
+shared_ptr<InprocEndpoint> FindInproc(string_view host) {
+    auto& registry = GetRegistry();
+    shared_lock<shared_mutex> lock(registry.mutex);
+    if (auto it = registry.endpoints.find(host); it != registry.endpoints.end()) {
+        if (auto endpoint = it->second.lock()) return endpoint;
+    }
+    throw Exception("inproc: no server at " + string(host));
+}
+
+class InprocEndpoint::Impl {
+public:
+    ~Impl() {
+        for (auto&[method, subscribers] : subscribers_) Close(subscribers);
+    }
+
+    void AddRpc(string_view method, InprocRpc&& rpc) {
+        unique_lock<shared_mutex> lock(mutex_);
+        rpcs_.insert_or_assign(string(method), move(rpc));
+    }
+
+    void AddPublish(string_view method) {
+        unique_lock<shared_mutex> lock(mutex_);
+        subscribers_.try_emplace(string(method));
+    }
+
+    void Del(string_view method) {
+        unique_lock<shared_mutex> lock(mutex_);
+        if (auto it = rpcs_.find(method); it != rpcs_.end()) rpcs_.erase(it);
+        if (auto it = subscribers_.find(method); it != subscribers_.end()) {
+            count_ -= it->second.size();
+            Close(it->second);
+            subscribers_.erase(it);
+        }
+    }
+
+    void Publish(string_view method, const string& data, type_index type, const void* msg) {
+        if (!count_.load(memory_order_relaxed)) return;
+        shared_lock<shared_mutex> lock(mutex_);
+        auto it = subscribers_.find(method);
+        if (it == subscribers_.end()) return;
+        for (auto&[id, subscriber] : it->second) {
+            if (msg && subscriber->typed && subscriber->type == type) {
+                subscriber->typed(msg);
+            } else {
+                subscriber->raw(folly::Try<string>(data));
+            }
+        }
+    }
+
+    folly::SemiFuture<string> Call(string_view method, MessageType type, string&& data) {
+        shared_ptr<const RawRpc> raw;
+        {
+            shared_lock<shared_mutex> lock(mutex_);
+            auto it = rpcs_.find(method);
+            if (it == rpcs_.end()) throw Exception("inproc: no rpc " + string(method));
+            if (it->second.type != type) throw Exception("inproc: wrong message type for " + string(method));
+            raw = it->second.raw;
+        }
+        return (*raw)(move(data));
+    }
+
+    shared_ptr<const void> Typed(string_view method, type_index description) {
+        shared_lock<shared_mutex> lock(mutex_);
+        auto it = rpcs_.find(method);
+        if (it == rpcs_.end() || it->second.description != description) return nullptr;
+        return it->second.typed;
+    }
+
+    uint64_t Subscribe(string_view method, InprocSubscriber&& subscriber) {
+        unique_lock<shared_mutex> lock(mutex_);
+        auto it = subscribers_.find(method);
+        if (it == subscribers_.end()) throw Exception("inproc: no publish " + string(method));
+        it->second.emplace_back(++last_id_, make_shared<const InprocSubscriber>(move(subscriber)));
+        ++count_;
+        return last_id_;
+    }
+
+    void Unsubscribe(string_view method, uint64_t id) {
+        unique_lock<shared_mutex> lock(mutex_);
+        auto it = subscribers_.find(method);
+        if (it == subscribers_.end()) return;
+        auto& subscribers = it->second;
+        auto found = find_if(subscribers.begin(), subscribers.end(), [id](const auto& s) { return s.first == id; });
+        if (found == subscribers.end()) return;
+        subscribers.erase(found);
+        --count_;
+    }
+
+private:
+    using Subscribers = vector<pair<uint64_t, shared_ptr<const InprocSubscriber>>>;
+
+    static void Close(const Subscribers& subscribers) {
+        for (auto&[id, subscriber] : subscribers) {
+            subscriber->raw(folly::Try<string>(folly::make_exception_wrapper<Exception>("inproc: publish closed")));
+        }
+    }
+
+    shared_mutex mutex_;
+    map<string, InprocRpc, less<>> rpcs_;
+    map<string, Subscribers, less<>> subscribers_;
+    uint64_t last_id_ = 0;
+    //publishes skip the lock while nobody subscribes
+    atomic<size_t> count_ = {0};
+};
+
+InprocEndpoint::InprocEndpoint() : pimpl_(make_shared<Impl>()) {}
+
+void InprocEndpoint::Listen(string_view uri) {
+    if (!IsInproc(uri)) throw Exception("inproc: " + string(uri) + " is not an inproc:// uri");
+    auto& registry = GetRegistry();
+    unique_lock<shared_mutex> lock(registry.mutex);
+    for (auto it = registry.endpoints.begin(); it != registry.endpoints.end();) {
+        it = it->second.expired() ? registry.endpoints.erase(it) : next(it);
+    }
+    if (!registry.endpoints.try_emplace(string(uri), weak_from_this()).second) {
+        throw Exception("inproc: " + string(uri) + " is already in use");
+    }
+}
+
+void InprocEndpoint::AddRpc(string_view method, InprocRpc&& rpc) {
+    pimpl_->AddRpc(method, move(rpc));
+}
+
+void InprocEndpoint::AddPublish(string_view method) {
+    pimpl_->AddPublish(method);
+}
+
+void InprocEndpoint::Del(string_view method) {
+    pimpl_->Del(method);
+}
+
+void InprocEndpoint::Publish(string_view method, const string& data, type_index type, const void* msg) {
+    pimpl_->Publish(method, data, type, msg);
+}
+
+folly::SemiFuture<string> InprocEndpoint::Call(string_view method, MessageType type, string&& data) const {
+    return pimpl_->Call(method, type, move(data));
+}
+
+shared_ptr<const void> InprocEndpoint::Typed(string_view method, type_index description) const {
+    return pimpl_->Typed(method, description);
+}
+
+shared_ptr<void> InprocEndpoint::Subscribe(string_view method, InprocSubscriber&& subscriber) {
+    auto id = pimpl_->Subscribe(method, move(subscriber));
+    weak_ptr<Impl> weak = pimpl_;
+    return shared_ptr<void>(nullptr, [weak, method = string(method), id](void*) {
+        if (auto impl = weak.lock()) impl->Unsubscribe(method, id);
+    });
+}
+
+}//amrpc::detail
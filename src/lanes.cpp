@@ -0,0 +1,137 @@
+#include "amrpc.h"
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+#include <folly/Executor.h>
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+using Clock = chrono::steady_clock;
+
+constexpr size_t LANES = 3;
+
+//Each task added to a lane posts one pump to the amrpc executor, the pump runs the most urgent task.
+class Lanes {
+public:
+    class Lane : public folly::Executor {
+    public:
+        Lane(Lanes& lanes, Priority priority) : lanes_(lanes), priority_(priority) {}
+
+        void add(folly::Func func) override {
+            lanes_.Add(priority_, move(func));
+        }
+
+    private:
+        Lanes& lanes_;
+        Priority priority_;
+    };
+
+    Lanes() : lanes_{Lane(*this, PRIORITY_CONTROL), Lane(*this, PRIORITY_NORMAL), Lane(*this, PRIORITY_BULK)} {}
+
+    folly::Executor& Get(Priority priority) {
+        return lanes_[priority];
+    }
+
+    void Add(Priority priority, folly::Func func) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            queues_[priority].push_back({move(func), Clock::now()});
+        }
+        GetAmrpcExecutor().add([this]() { RunOne(); });
+    }
+
+    LaneStats Stats(Priority priority) {
+        lock_guard<mutex> lock(mutex_);
+        auto stats = stats_[priority];
+        stats.pending = queues_[priority].size();
+        return stats;
+    }
+
+    void SetMaxWait(chrono::milliseconds max_wait) {
+        max_wait_ = chrono::duration_cast<Clock::duration>(max_wait).count();
+    }
+
+private:
+    struct Task {
+        folly::Func func;
+        Clock::time_point enqueued;
+    };
+
+    void RunOne() {
+        folly::Func func;
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto now = Clock::now();
+            auto index = Pick(now);
+            auto& queue = queues_[index];
+            func = move(queue.front().func);
+            auto wait = chrono::duration_cast<chrono::microseconds>(now - queue.front().enqueued);
+            queue.pop_front();
+            auto& stats = stats_[index];
+            ++stats.executed;
+            stats.total_wait += wait;
+            stats.max_wait = max(stats.max_wait, wait);
+        }
+        try {
+            func();
+        } catch (const exception& e) {
+            LOG(ERROR) << "amrpc lane task threw: " << e.what();
+        }
+    }
+
+    //called with mutex_ held, there is at least one task as pumps and tasks are added in pairs
+    size_t Pick(Clock::time_point now) const {
+        auto max_wait = Clock::duration(max_wait_.load(memory_order_relaxed));
+        optional<size_t> first;
+        optional<size_t> starved;
+        for (size_t i = 0; i < LANES; ++i) {
+            if (queues_[i].empty()) continue;
+            if (!first) first = i;
+            //starvation protection: the task waiting longest past max_wait goes first
+            if (now - queues_[i].front().enqueued >= max_wait &&
+                (!starved || queues_[i].front().enqueued < queues_[*starved].front().enqueued)) {
+                starved = i;
+            }
+        }
+        return starved ? *starved : *first;
+    }
+
+    array<Lane, LANES> lanes_;
+    mutex mutex_;
+    array<deque<Task>, LANES> queues_;
+    array<LaneStats, LANES> stats_;
+    atomic<Clock::rep> max_wait_ = {chrono::duration_cast<Clock::duration>(chrono::milliseconds(100)).count()};
+};
+
+//never destroyed, tasks may still be added during shutdown
+Lanes& GetLanes() {
+    static auto lanes = new Lanes();
+    return *lanes;
+}
+}//namespace
+
+folly::Executor& GetLaneExecutor(Priority priority) {
+    return GetLanes().Get(priority);
+}
+
+}//amrpc::detail
+
+namespace amrpc {
+
+LaneStats GetLaneStats(Priority priority) {
+    return detail::GetLanes().Stats(priority);
+}
+
+void SetLaneMaxWait(std::chrono::milliseconds max_wait) {
+    detail::GetLanes().SetMaxWait(max_wait);
+}
+
+}//amrpc
@@ -0,0 +1,137 @@
+#include "amrpc.h"
+
+#include <mutex>
+#include <string>
+
+#include <dirent.h>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <folly/futures/Future.h>
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace amrpc::detail {
+
+namespace {
+struct Placement {
+    mutex mtx;
+    PlacementOptions options;
+    //tid -> placement, threads of the same name are kept apart
+    map<int, ThreadPlacement> threads;
+};
+
+//never destroyed, background threads may be placed during shutdown
+Placement& GetPlacement() {
+    static auto placement = new Placement();
+    return *placement;
+}
+
+vector<int> AllowedCpus() {
+    vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+//-1 if unknown, sysfs links cpuN/nodeM for the node of the cpu
+int NodeOfCpu(int cpu) {
+    auto dir = opendir(("/sys/devices/system/cpu/cpu" + to_string(cpu)).c_str());
+    if (!dir) return -1;
+    int node = -1;
+    while (auto entry = readdir(dir)) {
+        string_view name(entry->d_name);
+        if (name.size() > 4 && name.rfind("node", 0) == 0) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+//the node of all cpus, -1 if they span several nodes or a node is unknown
+int CommonNode(const vector<int>& cpus) {
+    int common = -1;
+    for (auto cpu : cpus) {
+        auto node = NodeOfCpu(cpu);
+        if (node < 0 || (common >= 0 && node != common)) return -1;
+        common = node;
+    }
+    return common;
+}
+
+//the memory policy is per thread, pages touched later by this thread come from node first,
+//a negative node restores the default policy
+void PreferNode(int node) {
+    if (node >= 64) return;
+    unsigned long mask = node >= 0 ? 1ul << node : 0;
+    auto res = node >= 0 ? syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1)
+                         : syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    if (res != 0) LOG(WARNING) << "amrpc: set memory policy for numa node " << node << " failed";
+}
+}//namespace
+
+void PlaceThread(ThreadRole role, string_view name) {
+    auto& placement = GetPlacement();
+    lock_guard<mutex> lock(placement.mtx);
+    auto& cpus = role == THREAD_AMRPC ? placement.options.amrpc_cpus : placement.options.background_cpus;
+    ThreadPlacement thread;
+    thread.name = name;
+    thread.tid = static_cast<int>(syscall(SYS_gettid));
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        }
+        //the thread is migrated before this returns
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            LOG(WARNING) << "amrpc: pin " << name << " failed";
+        }
+    }
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        thread.cpu = static_cast<int>(cpu);
+        thread.node = static_cast<int>(node);
+    }
+    thread.cpus = AllowedCpus();
+    //a set spanning several nodes, or a thread given back to the scheduler, takes the default policy again
+    PreferNode(!cpus.empty() && placement.options.numa_local ? CommonNode(thread.cpus) : -1);
+    placement.threads.insert_or_assign(thread.tid, move(thread));
+}
+
+}//amrpc::detail
+
+namespace amrpc {
+
+void SetThreadPlacement(const PlacementOptions& options) {
+    auto& placement = detail::GetPlacement();
+    {
+        lock_guard<mutex> lock(placement.mtx);
+        placement.options = options;
+    }
+    folly::via(&detail::GetAmrpcExecutor(), []() {
+        detail::PlaceThread(detail::THREAD_AMRPC, "amrpc_evb");
+    }).get();
+}
+
+std::vector<ThreadPlacement> GetThreadPlacement() {
+    auto& placement = detail::GetPlacement();
+    lock_guard<mutex> lock(placement.mtx);
+    vector<ThreadPlacement> threads;
+    for (auto&[tid, thread] : placement.threads) threads.push_back(thread);
+    return threads;
+}
+
+}//amrpc